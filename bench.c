@@ -0,0 +1,352 @@
+/*
+  Load generator for the chat server.
+
+  Opens a number of registered clients using the connection routines from
+  test.c, then has them send PRIVMSGs at a steady rate, either straight to
+  another client or to a channel they share with others (fan-out). Reports
+  the connection setup rate, how much memory the server holds for each
+  idle client, message throughput, how many system calls the server made
+  per message (from its STATS), and a histogram of the time from a message
+  being sent to it arriving.
+
+  usage: bench [-n clients] [-r messages/sec] [-d seconds] [-f fan-out]
+               <port | server program [server options]>
+*/
+
+#define TEST_NO_MAIN
+#include "test.c"
+
+#include <poll.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/tcp.h>
+
+struct bench_client {
+  int fd;
+  char nick[32];
+  // channel we send to when fan-out is more than 1
+  int group;
+  char in[8192];
+  int in_len;
+};
+
+struct bench_client *clients;
+int client_count=1000;
+double message_rate=10000;
+int duration=10;
+int fanout=1;
+
+long long sent=0,stalled=0,expected=0,received=0;
+long long syscalls=-1;
+long long resident_before=-1,resident_after=-1;
+long long *latencies;
+int latency_count=0,latency_size=0;
+
+// clients are connected and registered this many at a time
+#define CONNECT_BATCH 64
+
+long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec*1000000000LL+ts.tv_nsec;
+}
+
+// reads into buffer until it contains marker. returns -1 if it has not
+// turned up within timeout_ms.
+int bench_read_until(int fd,char *buffer,int *bytes,int size,char *marker,int timeout_ms) {
+  long long give_up=now_ns()+timeout_ms*1000000LL;
+  buffer[*bytes]=0;
+  while(!strstr(buffer,marker)) {
+    int left=(give_up-now_ns())/1000000;
+    if (left<=0||*bytes>=size-1) return -1;
+    struct pollfd p={fd,POLLIN,0};
+    if (poll(&p,1,left)<1) continue;
+    int r=read(fd,&buffer[*bytes],size-1-*bytes);
+    if (r<=0) return -1;
+    *bytes+=r;
+    buffer[*bytes]=0;
+  }
+  return 0;
+}
+
+int write_all(int fd,char *data,int len) {
+  while(len>0) {
+    int w=write(fd,data,len);
+    if (w==-1) {
+      if (errno!=EAGAIN&&errno!=EINTR) return -1;
+      struct pollfd p={fd,POLLOUT,0};
+      poll(&p,1,100);
+      continue;
+    }
+    data+=w;
+    len-=w;
+  }
+  return 0;
+}
+
+// connects and registers clients first..first+count-1, sending every
+// NICK and USER before waiting for any of the replies
+int bench_connect(int first,int count) {
+  char cmd[1024];
+  int i;
+  for(i=first;i<first+count;i++) {
+    struct bench_client *c=&clients[i];
+    c->fd=connect_to_port(student_port);
+    if (c->fd==-1) return -1;
+    int on=1;
+    setsockopt(c->fd,IPPROTO_TCP,TCP_NODELAY,&on,sizeof(on));
+    snprintf(c->nick,sizeof(c->nick),"bn%d_%d",(int)(getpid()%100000),i);
+    c->group=i/fanout;
+    snprintf(cmd,1024,"NICK %s\r\nUSER %s 0 * :bench\r\n",c->nick,c->nick);
+    if (write_all(c->fd,cmd,strlen(cmd))) return -1;
+  }
+  for(i=first;i<first+count;i++) {
+    struct bench_client *c=&clients[i];
+    char buffer[8192];
+    int bytes=0;
+    if (bench_read_until(c->fd,buffer,&bytes,sizeof(buffer)," 255 ",5000)) {
+      printf("FAIL: %s was not registered\n",c->nick);
+      return -1;
+    }
+    if (test_next_response_is("020","*",buffer,&bytes,"connection",NULL,1)||
+        test_next_response_is("001",c->nick,buffer,&bytes,"USER",NULL,1)) {
+      printf("FAIL: unexpected registration reply for %s: '%s'\n",c->nick,buffer);
+      return -1;
+    }
+  }
+  if (fanout<2) return 0;
+  for(i=first;i<first+count;i++) {
+    snprintf(cmd,1024,"JOIN #bench%d\r\n",clients[i].group);
+    if (write_all(clients[i].fd,cmd,strlen(cmd))) return -1;
+  }
+  for(i=first;i<first+count;i++) {
+    char buffer[8192];
+    int bytes=0;
+    if (bench_read_until(clients[i].fd,buffer,&bytes,sizeof(buffer)," 366 ",5000)) {
+      printf("FAIL: %s could not join its channel\n",clients[i].nick);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void send_message(void) {
+  int i=random()%client_count;
+  struct bench_client *c=&clients[i];
+  char cmd[1024];
+  int members;
+  if (fanout>1) {
+    members=client_count-c->group*fanout;
+    if (members>fanout) members=fanout;
+    if (members<2) return;
+    snprintf(cmd,1024,"PRIVMSG #bench%d :%lld\r\n",c->group,now_ns());
+  } else {
+    int target=(i+1+random()%(client_count-1))%client_count;
+    members=2;
+    snprintf(cmd,1024,"PRIVMSG %s :%lld\r\n",clients[target].nick,now_ns());
+  }
+  int len=strlen(cmd);
+  int w=write(c->fd,cmd,len);
+  if (w==-1) { stalled++; return; }
+  if (w<len) write_all(c->fd,&cmd[w],len-w);
+  sent++;
+  expected+=members-1;
+}
+
+void record_latency(long long ns) {
+  if (latency_count>=latency_size) {
+    int size=latency_size?latency_size*2:65536;
+    long long *l=realloc(latencies,size*sizeof(long long));
+    if (!l) return;
+    latencies=l;
+    latency_size=size;
+  }
+  latencies[latency_count++]=ns;
+}
+
+// reads whatever has arrived for a client, timing each PRIVMSG
+void receive(struct bench_client *c) {
+  while(1) {
+    int r=read(c->fd,&c->in[c->in_len],sizeof(c->in)-1-c->in_len);
+    if (r<=0) return;
+    long long now=now_ns();
+    c->in_len+=r;
+    c->in[c->in_len]=0;
+    char *line=c->in,*eol;
+    while((eol=strchr(line,'\n'))) {
+      *eol=0;
+      char *body;
+      if (strstr(line," PRIVMSG ")&&(body=strstr(line," :"))) {
+        received++;
+        record_latency(now-strtoll(body+2,NULL,10));
+      }
+      line=eol+1;
+    }
+    c->in_len-=line-c->in;
+    memmove(c->in,line,c->in_len);
+  }
+}
+
+// asks the server how many system calls it has made so far, or -1 if it
+// does not say
+long long server_syscalls(struct bench_client *c) {
+  char buffer[65536];
+  int bytes=0;
+  if (write_all(c->fd,"STATS\r\n",7)||
+      bench_read_until(c->fd,buffer,&bytes,sizeof(buffer)," 219 ",5000)) return -1;
+  char *p=strstr(buffer,"system calls ");
+  return p?atoll(p+13):-1;
+}
+
+// the server's resident memory in bytes, or -1 if we did not start it
+long long server_resident(void) {
+  if (student_pid<=100||student_pid==99999) return -1;
+  char path[64],line[256];
+  snprintf(path,64,"/proc/%d/status",(int)student_pid);
+  FILE *f=fopen(path,"r");
+  if (!f) return -1;
+  long long kb=-1;
+  while(fgets(line,256,f))
+    if (!strncmp(line,"VmRSS:",6)) kb=atoll(line+6);
+  fclose(f);
+  return kb<0?-1:kb*1024;
+}
+
+int compare_latency(const void *a,const void *b) {
+  long long x=*(long long *)a,y=*(long long *)b;
+  return x<y?-1:x>y;
+}
+
+double percentile(double p) {
+  if (!latency_count) return 0;
+  int i=p*latency_count;
+  if (i>=latency_count) i=latency_count-1;
+  return latencies[i]/1000000.0;
+}
+
+void report(double setup_seconds,double run_seconds) {
+  printf("clients     %d (fan-out %d)\n",client_count,fanout);
+  printf("setup       %.2f s, %.0f clients/sec\n",setup_seconds,client_count/setup_seconds);
+  if (resident_before>=0&&resident_after>=0&&client_count)
+    printf("memory      %.0f bytes resident in the server per idle client\n",
+           (double)(resident_after-resident_before)/client_count);
+  printf("sent        %lld messages, %.0f/sec, %lld stalled\n",sent,sent/run_seconds,stalled);
+  printf("delivered   %lld of %lld expected, %.0f/sec\n",received,expected,received/run_seconds);
+  if (syscalls>=0&&received)
+    printf("syscalls    %lld, %.2f per message delivered\n",syscalls,(double)syscalls/received);
+  if (!latency_count) return;
+  qsort(latencies,latency_count,sizeof(long long),compare_latency);
+  printf("latency     p50 %.3f ms  p99 %.3f ms  p999 %.3f ms  max %.3f ms\n",
+         percentile(0.5),percentile(0.99),percentile(0.999),
+         latencies[latency_count-1]/1000000.0);
+
+  // how many messages took up to each power of two microseconds
+  int i=0;
+  long long limit=1000;
+  while(i<latency_count) {
+    int n=0;
+    while(i<latency_count&&latencies[i]<=limit) { i++; n++; }
+    if (n) printf("  <= %8lld us %9d %6.2f%%\n",limit/1000,n,n*100.0/latency_count);
+    limit*=2;
+  }
+}
+
+void usage(void) {
+  fprintf(stderr,"usage: bench [-n clients] [-r messages/sec] [-d seconds] [-f fan-out]\n"
+          "             <port | server program [server options]>\n");
+  exit(-1);
+}
+
+int main(int argc,char **argv)
+{
+  int opt;
+  while((opt=getopt(argc,argv,"+n:r:d:f:"))!=-1) {
+    switch(opt) {
+    case 'n': client_count=atoi(optarg); break;
+    case 'r': message_rate=atof(optarg); break;
+    case 'd': duration=atoi(optarg); break;
+    case 'f': fanout=atoi(optarg); break;
+    default: usage();
+    }
+  }
+  if (optind>=argc||client_count<2||message_rate<=0||duration<1||fanout<1) usage();
+
+  // thousands of clients need thousands of descriptors
+  struct rlimit rl;
+  if (!getrlimit(RLIMIT_NOFILE,&rl)) {
+    rl.rlim_cur=rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE,&rl);
+  }
+  signal(SIGPIPE,SIG_IGN);
+
+  if (atoi(argv[optind])==0)
+    launch_student_programme(argv[optind],&argv[optind+1]);
+  else {
+    student_port=atoi(argv[optind]);
+    student_pid=99999;
+  }
+  if (student_pid<0||test_listensonport()) {
+    printf("FAIL: Could not reach the server\n");
+    return -1;
+  }
+
+  clients=calloc(client_count,sizeof(struct bench_client));
+  if (!clients) return -1;
+
+  resident_before=server_resident();
+  long long start=now_ns();
+  int i;
+  for(i=0;i<client_count;i+=CONNECT_BATCH) {
+    int count=client_count-i<CONNECT_BATCH?client_count-i:CONNECT_BATCH;
+    if (bench_connect(i,count)) {
+      printf("FAIL: Could only connect %d clients\n",i);
+      client_count=i;
+      break;
+    }
+  }
+  double setup_seconds=(now_ns()-start)/1e9;
+  // every client has been answered, so all of them are idle now
+  usleep(100000);
+  resident_after=server_resident();
+  long long syscalls_before=client_count?server_syscalls(&clients[0]):-1;
+
+  int epfd=epoll_create1(0);
+  for(i=0;i<client_count;i++) {
+    fcntl(clients[i].fd,F_SETFL,fcntl(clients[i].fd,F_GETFL,NULL)|O_NONBLOCK);
+    struct epoll_event ev;
+    ev.events=EPOLLIN;
+    ev.data.u32=i;
+    epoll_ctl(epfd,EPOLL_CTL_ADD,clients[i].fd,&ev);
+  }
+
+  // send at the requested rate for the run, then give stragglers a couple
+  // of seconds to turn up
+  struct epoll_event events[256];
+  start=now_ns();
+  long long end=start+duration*1000000000LL;
+  long long drain=end+2000000000LL;
+  long long now=start;
+  while(client_count>1&&now<drain&&(now<end||received<expected)) {
+    if (now<end) {
+      long long due=(now-start)/1e9*message_rate;
+      while(sent+stalled<due) send_message();
+    }
+    int n=epoll_wait(epfd,events,256,1);
+    for(i=0;i<n;i++) receive(&clients[events[i].data.u32]);
+    now=now_ns();
+  }
+  double run_seconds=(now<end?now:end)-start;
+  if (syscalls_before>=0) {
+    long long after=server_syscalls(&clients[0]);
+    if (after>=0) syscalls=after-syscalls_before;
+  }
+  report(setup_seconds,run_seconds/1e9);
+
+  for(i=0;i<client_count;i++) {
+    write(clients[i].fd,"QUIT\r\n",6);
+    close(clients[i].fd);
+  }
+  if (student_pid>100&&student_pid!=99999) kill(student_pid,SIGKILL);
+  return 0;
+}
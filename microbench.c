@@ -0,0 +1,424 @@
+/*
+  Microbenchmark for the line parser in sample.c.
+
+  Times the old strncasecmp/sscanf chain that parse_line used to run on
+  every line against message_parse and the command table, over a mix of
+  typical client lines, and reports lines per second for each.
+
+  Checks the timer wheel with a million timers spread over its coarser
+  rings, a third of them cancelled and some moved, and reports how long
+  running the clock past them takes and whether any fired at the wrong
+  tick.
+
+  Then times private messages sent by 1, 2, 4... threads at once (up to
+  twice the number of processors), each to a reader of its own, to show
+  how appending scales without a shared lock. The same number of threads
+  then push numbered mail into one inbox while it is read, and any mail
+  lost, seen twice or out of its sender's order is counted. Last comes
+  how a PRIVMSG to 32
+  nicknames at once compares with 32 separate ones, for a short text and
+  a 200 byte one.
+
+  Given a directory, also times appending private messages with the
+  journal off and on, and how long it takes to recover a journal
+  of many messages (10 million unless told otherwise). Anything already
+  journalled in the directory is deleted first.
+
+  usage: microbench [seconds per run] [journal directory [messages]]
+*/
+
+// pull in the server without its main()
+#define main sample_main
+#include "sample.c"
+#undef main
+
+#include <sys/time.h>
+
+char *sample_lines[]={
+  "PRIVMSG wecoyote :Hello, how are you today?",
+  "PRIVMSG #roadrunners :meep meep",
+  "NICK roadrunner",
+  "USER roadrunner 0 * :Road Runner",
+  "JOIN #acme,#roadrunners",
+  "PART #acme",
+  "NAMES #roadrunners",
+  "PONG :ircserver.com",
+  "QUIT :gone",
+  NULL
+};
+
+long long now_us(void) {
+  struct timeval tv;
+  gettimeofday(&tv,NULL);
+  return tv.tv_sec*1000000LL+tv.tv_usec;
+}
+
+// what parse_line did before: every test runs whatever the command is, and
+// copies into 8KB buffers on the stack
+int legacy_classify(char *buffer) {
+  char channel[8192];
+  char nickname[8192];
+  int kind=0;
+
+  if (!strncasecmp("QUIT",buffer,4)) return 1;
+  if (!strncasecmp("PRIVMSG",buffer,7)) {
+    char recipient[1024];
+    char message[1024];
+    if (sscanf(buffer, "PRIVMSG %s :%[^\n]",recipient,message)==2) kind=2;
+  }
+  if (sscanf((char *)buffer,"JOIN %s",channel)==1) kind=3;
+  if (sscanf((char *)buffer,"PART %s",channel)==1) kind=4;
+  if (sscanf((char *)buffer,"NAMES %s",channel)==1) kind=5;
+  if (sscanf((char *)buffer,"NICK %s",nickname)==1) kind=6;
+  if (sscanf((char *)buffer,"USER %s",channel)==1) kind=7;
+  return kind;
+}
+
+int table_classify(char *buffer) {
+  struct message m;
+  if (message_parse(buffer,&m)) return 0;
+  struct command *c=command_find(&m,0);
+  return c?c-commands+1:0;
+}
+
+double run(const char *name,int (*classify)(char *),double seconds) {
+  char line[1024];
+  long long lines=0,sum=0;
+  long long start=now_us(),end=start+seconds*1000000;
+  while(now_us()<end) {
+    int i,j;
+    for(j=0;j<1000;j++)
+      for(i=0;sample_lines[i];i++) {
+        // the new parser cuts the line up, so both get a fresh copy
+        strcpy(line,sample_lines[i]);
+        sum+=classify(line);
+        lines++;
+      }
+  }
+  double rate=lines/((now_us()-start)/1000000.0);
+  printf("%-10s %12.0f lines/sec (checksum %lld)\n",name,rate,sum);
+  return rate;
+}
+
+struct check_timer {
+  struct timer timer;
+  long long due;
+  int fired;
+  int cancelled;
+};
+
+int timers_wrong=0;
+
+void check_timer_fire(struct timer_wheel *w,struct timer *timer) {
+  struct check_timer *c=timer->data;
+  if (c->fired++||c->cancelled||w->now!=c->due) timers_wrong++;
+}
+
+// timers due anywhere in the first three rings, so most of them cascade
+// down at least once, with every third taken out again and every seventh
+// moved, some of those back in after being taken out. as many timers share each slot, most of those are not at the
+// head of it.
+void timer_check(int count) {
+  struct timer_wheel w;
+  timer_wheel_init(&w);
+  struct check_timer *timers=calloc(count,sizeof(struct check_timer));
+  if (!timers) return;
+  long long start=w.now,span=1LL<<(TIMER_BITS*3);
+  int i;
+  srandom(1);
+  for(i=0;i<count;i++) {
+    timers[i].timer.fire=check_timer_fire;
+    timers[i].timer.data=&timers[i];
+    timers[i].due=start+1+random()%span;
+    timer_schedule(&w,&timers[i].timer,timers[i].due);
+  }
+  for(i=0;i<count;i+=3) {
+    timer_cancel(&w,&timers[i].timer);
+    timers[i].cancelled=1;
+  }
+  for(i=1;i<count;i+=7) {
+    timers[i].cancelled=0;
+    timers[i].due=start+1+random()%span;
+    timer_schedule(&w,&timers[i].timer,timers[i].due);
+  }
+  timers_wrong=0;
+  long long begin=now_us();
+  timer_advance(&w,start+span+1);
+  double took=(now_us()-begin)/1000.0;
+  for(i=0;i<count;i++)
+    if (!timers[i].cancelled&&!timers[i].fired) timers_wrong++;
+  printf("timers     %12d over %lld ticks in %.1f ms, %d fired wrongly or not at all\n",
+         count,span,took,timers_wrong+w.count);
+  free(timers);
+}
+
+void journal_clear(char *dir) {
+  DIR *d=opendir(dir);
+  if (!d) return;
+  struct dirent *de;
+  int index;
+  char path[1024];
+  while((de=readdir(d))) {
+    if (sscanf(de->d_name,"journal.%d",&index)!=1) continue;
+    snprintf(path,1024,"%s/%s",dir,de->d_name);
+    unlink(path);
+  }
+  closedir(d);
+}
+
+// empties the message log, as if the server had just started
+void log_reset(void) {
+  while(message_log_tail<message_count) message_log_free(message_log_tail++);
+  message_log_tail=message_count=0;
+}
+
+// sends count messages to a client that reads them as they come, writing
+// to /dev/null, and returns messages per second
+double append_run(const char *name,struct client_thread *t,long long count) {
+  char text[64];
+  long long i,start=now_us();
+  for(i=0;i<count;i++) {
+    snprintf(text,64,"message number %lld",i);
+    message_log_append("wecoyote!myusername@myserver","roadrunner",text);
+    if (i%1000==999) inbox_read(t);
+  }
+  inbox_read(t);
+  double rate=count/((now_us()-start)/1000000.0);
+  printf("%-10s %12.0f appends/sec\n",name,rate);
+  return rate;
+}
+
+struct append_thread {
+  pthread_t thread;
+  char nick[32];
+  long long count;
+};
+
+// sends messages to a nickname of its own and reads them back
+void *append_thread(void *data) {
+  struct append_thread *a=data;
+  struct client_thread *t=client_new(open("/dev/null",O_WRONLY));
+  t->wakefd=-1;
+  nick_claim(t,a->nick);
+  char text[64];
+  long long i;
+  for(i=0;i<a->count;i++) {
+    snprintf(text,64,"message number %lld",i);
+    message_log_append("wecoyote!myusername@myserver",a->nick,text);
+    if (i%1000==999) inbox_read(t);
+  }
+  inbox_read(t);
+  client_unregister(t);
+  close(t->fd);
+  slab_free(t);
+  return NULL;
+}
+
+void append_scaling(double seconds) {
+  int max=sysconf(_SC_NPROCESSORS_ONLN)*2;
+  long long count=seconds*500000;
+  struct append_thread threads[256];
+  int n,i;
+  for(n=1;n<=max&&n<=256;n*=2) {
+    long long start=now_us();
+    for(i=0;i<n;i++) {
+      snprintf(threads[i].nick,32,"reader%d",i);
+      threads[i].count=count/n;
+      pthread_create(&threads[i].thread,NULL,append_thread,&threads[i]);
+    }
+    for(i=0;i<n;i++) pthread_join(threads[i].thread,NULL);
+    double rate=count/n*n/((now_us()-start)/1000000.0);
+    printf("%3d thread%s %12.0f appends/sec\n",n,n>1?"s":" ",rate);
+  }
+}
+
+struct inbox_producer {
+  pthread_t thread;
+  struct inbox *inbox;
+  int id;
+  long long count;
+};
+
+int inbox_producers_done;
+
+// pushes mail numbered by sender and sequence into a shared inbox
+void *inbox_producer(void *data) {
+  struct inbox_producer *p=data;
+  long long i;
+  for(i=0;i<p->count;i++) {
+    struct mail *m=pool_alloc(sizeof(struct mail));
+    if (!m) continue;
+    m->message=((long long)p->id<<40)|i;
+    inbox_push(p->inbox,m);
+  }
+  __atomic_add_fetch(&inbox_producers_done,1,__ATOMIC_RELEASE);
+  return NULL;
+}
+
+// n threads push into one inbox while this one pops, checking that every
+// sender's mail comes out once each and in the order it went in
+void inbox_check(double seconds) {
+  int n=sysconf(_SC_NPROCESSORS_ONLN)*2,i;
+  if (n<4) n=4;
+  if (n>256) n=256;
+  struct inbox_producer producers[256];
+  long long expected[256];
+  long long count=seconds*1000000/n,popped=0,wrong=0;
+  struct inbox inbox;
+  inbox_init(&inbox);
+  inbox_producers_done=0;
+  long long start=now_us();
+  for(i=0;i<n;i++) {
+    producers[i].inbox=&inbox;
+    producers[i].id=i;
+    producers[i].count=count;
+    expected[i]=0;
+    pthread_create(&producers[i].thread,NULL,inbox_producer,&producers[i]);
+  }
+  // a pop can find nothing while a push is half done, so only an empty
+  // inbox once every sender has finished means there is no more
+  while(1) {
+    int done=__atomic_load_n(&inbox_producers_done,__ATOMIC_ACQUIRE)==n;
+    struct mail *m=inbox_pop(&inbox);
+    if (!m) {
+      if (done) break;
+      continue;
+    }
+    int id=m->message>>40;
+    long long seq=m->message&((1LL<<40)-1);
+    if (id>=n||seq!=expected[id]) wrong++;
+    else expected[id]++;
+    popped++;
+    pool_free(m,sizeof(struct mail));
+  }
+  for(i=0;i<n;i++) pthread_join(producers[i].thread,NULL);
+  for(i=0;i<n;i++) if (expected[i]!=count) wrong++;
+  double rate=popped/((now_us()-start)/1000000.0);
+  printf("%3d senders %11.0f pops/sec into one inbox, %lld lost, repeated or out of order\n",
+         n,rate,wrong);
+}
+
+// writes count messages straight to a journal in dir. without the sync
+// thread nothing removes segments whose messages have left the log, so
+// they are all there to recover.
+void journal_write(char *dir,long long count) {
+  journal_dir=dir;
+  char text[64];
+  long long i,start=now_us();
+  for(i=0;i<count;i++) {
+    int len=snprintf(text,64,"message number %lld",i);
+    struct shared_message *sm=shared_message_privmsg("wecoyote!myusername@myserver",28,
+                                                      "roadrunner",10,text,len);
+    struct log_record *r=sm?log_record_new(sm,38,10,38,10):NULL;
+    if (sm) shared_message_release(sm);
+    int failed=!r||journal_append(r,i,0);
+    if (r) log_record_free(r);
+    if (failed) { perror("Could not write journal"); break; }
+  }
+  printf("%-10s %12.0f appends/sec\n","writing",i/((now_us()-start)/1000000.0));
+  while(journal_segments) {
+    struct journal_segment *s=journal_segments;
+    journal_segments=s->next;
+    munmap(s->map,JOURNAL_SEGMENT);
+    free(s);
+  }
+  journal_current=NULL;
+  journal_dir=NULL;
+}
+
+// sends the same text to FANOUT readers, either one nickname at a time or
+// as one target list, and reports deliveries per second for each, for a
+// short text and a long one
+#define FANOUT 32
+
+void fanout_bench(double seconds) {
+  struct client_thread *readers[FANOUT];
+  char names[FANOUT][32];
+  char *nicks[FANOUT],*missing[FANOUT];
+  char long_text[201];
+  char *texts[2]={"meep meep",long_text};
+  int i,list,text;
+  memset(long_text,'m',200);
+  long_text[200]=0;
+  for(i=0;i<FANOUT;i++) {
+    readers[i]=client_new(open("/dev/null",O_WRONLY));
+    readers[i]->wakefd=-1;
+    snprintf(names[i],32,"reader%d",i);
+    nick_claim(readers[i],names[i]);
+  }
+  long long count=seconds*250000/FANOUT;
+  for(text=0;text<2;text++) {
+    double rates[2];
+    for(list=0;list<2;list++) {
+      long long n,start=now_us();
+      for(n=0;n<count;n++) {
+        // privmsg_send may be handed the same strings again and again
+        for(i=0;i<FANOUT;i++) nicks[i]=names[i];
+        if (list) privmsg_send("wecoyote!myusername@myserver",nicks,FANOUT,texts[text],NULL,missing);
+        else for(i=0;i<FANOUT;i++) message_log_append("wecoyote!myusername@myserver",nicks[i],texts[text]);
+        if (n%32==31) for(i=0;i<FANOUT;i++) inbox_read(readers[i]);
+      }
+      for(i=0;i<FANOUT;i++) inbox_read(readers[i]);
+      rates[list]=count*FANOUT/((now_us()-start)/1000000.0);
+      printf("%-10s %12.0f deliveries/sec to %d nicknames, %d byte text\n",
+             list?"one list":"one each",rates[list],FANOUT,(int)strlen(texts[text]));
+    }
+    printf("speedup    %12.1fx\n",rates[1]/rates[0]);
+  }
+  for(i=0;i<FANOUT;i++) {
+    client_unregister(readers[i]);
+    close(readers[i]->fd);
+    slab_free(readers[i]);
+  }
+}
+
+void journal_bench(char *dir,long long recover,double seconds) {
+  if (message_log_init(message_log_size)) return;
+  struct client_thread *t=client_new(open("/dev/null",O_WRONLY));
+  t->wakefd=-1;
+  nick_claim(t,"roadrunner");
+  // roughly as long as each parser run
+  long long count=seconds*500000;
+
+  journal_clear(dir);
+  double off=append_run("no journal",t,count);
+  log_reset();
+  if (journal_open(dir)) { perror("Could not open journal"); return; }
+  double on=append_run("journal",t,count);
+  printf("journal    %12.1f%% of the rate without\n",on*100/off);
+  journal_close();
+  journal_clear(dir);
+
+  // keep every segment, as if nobody had read anything
+  log_reset();
+  journal_write(dir,recover);
+
+  long long start=now_us();
+  if (journal_open(dir)) { perror("Could not recover journal"); return; }
+  double took=(now_us()-start)/1000000.0;
+  printf("recovered  %12lld messages in %.2f s, %.0f/sec\n",message_count,took,message_count/took);
+  journal_close();
+  journal_clear(dir);
+}
+
+int main(int argc,char **argv) {
+  double seconds=argc>1?atof(argv[1]):2;
+  if (seconds<=0) seconds=2;
+  command_table_init();
+
+  double before=run("sscanf",legacy_classify,seconds);
+  double after=run("tokenizer",table_classify,seconds);
+  printf("speedup    %12.1fx\n",after/before);
+
+  timer_check(1000000);
+
+  nick_table_init();
+  stats_init();
+  pool_init();
+  append_scaling(seconds);
+  inbox_check(seconds);
+  fanout_bench(seconds);
+
+  if (argc>2) journal_bench(argv[2],argc>3?atoll(argv[3]):10000000,seconds);
+  return 0;
+}
@@ -20,15 +20,18 @@
 
 */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 // comment out below line on home PC
 //#include <sys/filio.h>
 #include <sys/ioctl.h>
 #include <fcntl.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <string.h>
 #include <strings.h>
 #include <signal.h>
@@ -37,6 +40,111 @@
 #include <errno.h>
 #include <pthread.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <stdarg.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+// a line that is sent to one or more connections. it is formatted once and
+// every recipient's mail holds a reference to it.
+struct shared_message {
+  int refs;
+  int len;
+  char data[];
+};
+
+// a line waiting in a connection's inbox, and with a journal the record
+// to mark delivered once it has been read
+struct mail {
+  struct mail *next;
+  struct shared_message *shared;
+  // a line to several nicknames is shared by all of them, and each is sent
+  // it with the target list cut down to their own nickname
+  unsigned short targets;
+  unsigned short targets_len;
+  unsigned short recipient;
+  unsigned short recipient_len;
+  // the recipient's bit in the journal entry's delivered mark
+  unsigned int *delivered;
+  unsigned int delivered_bit;
+  long long message;
+  // when it was queued, for the delivery latency statistics
+  long long queued;
+  // when the line was read, if it is being traced
+  long long traced;
+  // with a journal, the commit its record went out in. it is not
+  // delivered until that commit is on disk.
+  long long epoch;
+};
+
+// messages waiting for one connection. any thread may add to it without a
+// lock; only the connection's own thread takes from it. this is Vyukov's
+// intrusive queue: a sender swaps its mail in as the new head and then
+// links the old head to it, and the stub means the queue is never empty,
+// so the reader never has to touch head.
+struct inbox {
+  struct mail *head;
+  struct mail *tail;
+  struct mail stub;
+};
+
+// a run of bytes waiting to be written: either part of the connection's own
+// output buffer, or part of a shared line we hold a reference to
+struct output_segment {
+  struct shared_message *shared;
+  int offset;
+  int len;
+};
+
+// replies collect here while a command or a batch of deliveries is being
+// processed, and then go out in a single writev
+struct output {
+  char *buf;
+  int buf_len;
+  int buf_size;
+  struct output_segment *segments;
+  int count;
+  int size;
+  // bytes in all the segments
+  long long queued;
+};
+
+// timers are kept in a hierarchical wheel: TIMER_LEVELS rings of
+// TIMER_SLOTS slots, each ring's slots TIMER_SLOTS times coarser than the
+// last. a timer sits in the finest ring that can hold it and is moved down
+// as its time gets near, so advancing the clock only touches the slots that
+// are due and the timers in them.
+#define TIMER_LEVELS 4
+#define TIMER_BITS 6
+#define TIMER_SLOTS (1<<TIMER_BITS)
+
+struct timer_wheel;
+
+struct timer {
+  // in ticks of the wheel, which are seconds
+  long long expires;
+  void (*fire)(struct timer_wheel *w,struct timer *timer);
+  void *data;
+  struct timer *prev,*next;
+  int armed;
+};
+
+struct timer_wheel {
+  long long now;
+  int count;
+  struct timer *slots[TIMER_LEVELS][TIMER_SLOTS];
+};
+
+#define LINE_SIZE 1024
 
 struct client_thread {
   pthread_t thread;
@@ -44,329 +152,4997 @@ struct client_thread {
   int fd;
 
   char nickname[32];
+  // registry key for the nickname, and the next entry in its hash chain
+  char folded_nick[32];
+  struct client_thread *nick_next;
 
   int state;
   int user_command_seen;
   int user_has_registered;
   time_t timeout;
 
-  char line[1024];
+  // part of a line that has arrived without its end, up to LINE_SIZE-1
+  // bytes. the buffer comes from the pool, and only while there is such a
+  // line, so a quiet connection holds none.
+  char *line;
   int line_len;
 
-  int next_message;
+  // flood control. each bucket is kept as the time it will next be empty,
+  // which a line moves on by its cost. input that flood control stopped
+  // us getting to is held until flood_until.
+  long long flood_line_clock;
+  long long flood_byte_clock;
+  unsigned char *held;
+  int held_len;
+  int held_size;
+  // set while input is held. the idle timer looks at this rather than
+  // held, as in thread mode it fires on another thread.
+  int holding;
+  long long flood_until;
+  // on the worker's list of connections flood control has stopped
+  struct client_thread *flood_next;
+  int flood_listed;
+
+  // closes the connection if it stays idle for `timeout` seconds. the
+  // timer is only moved when it fires, not every time data arrives.
+  struct timer idle_timer;
+  struct timer_wheel *timers;
+  long long time_of_last_data;
+  int timed_out;
+  int sendq_exceeded;
+  // set by another thread when another server kills our nickname, and
+  // moved on to 2 once we have closed up
+  int killed;
+
+  // set while we have been told about new mail and have not yet looked.
+  // thread mode connections are told through their own eventfd.
+  int wake_pending;
+  int wakefd;
+
+  // messages addressed to us
+  struct inbox inbox;
+  // mail taken from the inbox whose journal commit is not on disk yet, and
+  // our place on the list of those waiting for the next commit
+  struct mail *journal_wait;
+  struct client_thread *journal_next;
+  int journal_waiting;
+
+  // channels we are on
+  struct membership *channels;
+
+  // replies not yet written to the socket
+  struct output output;
+
+  // only used in reactor mode: the worker that owns this connection,
+  // and its place in that worker's list of connections
+  struct reactor *reactor;
+  struct client_thread *prev,*next;
+  struct client_thread *ready_next;
+  // only used in io_uring mode
+  struct uring_conn *uring;
+  // handed over by the server we replaced, which has greeted it already
+  int restored;
+
+  // set once the connection has introduced itself as another server.
+  // linking is set while we wait for a server we connected to to do so,
+  // and link_peer says which -L peer that was.
+  struct server *server;
+  int linking;
+  int link_peer;
+  // gave the link password, so may introduce itself as a server
+  int link_authorised;
+  // a quiet link has been sent a PING, and is dropped if it stays quiet
+  int ping_sent;
 };
 
-// allocate static structure for all client connections
+// another server on the network. each is reached through one of our links:
+// the connection to it if it is linked to us, otherwise the connection to
+// the server that told us about it. servers are kept in the order we learn
+// of them, so a server always comes after the one that introduced it.
+struct server {
+  char name[64];
+  int hops;
+  // the server that introduced it, or NULL if it is linked to us
+  struct server *uplink;
+  struct client_thread *link;
+  struct remote_user *users;
+  struct server *next;
+};
+
+// a nickname in use on another server. these are hashed alongside our own
+// connections' nicknames, under the same locks.
+struct remote_user {
+  char nickname[32];
+  char folded_nick[32];
+  struct server *server;
+  struct remote_user *nick_next;
+  // the nickname their server has changed them to, if it was in use here.
+  // they keep the old one until the KILL we sent back for it has taken
+  // them off the network.
+  char renamed[32];
+  // place in server->users
+  struct remote_user *prev,*next;
+};
+
+// a message in the log: a reference to the line exactly as it is delivered,
+// and where the nicknames it is for are in it, separated by commas
+struct log_record {
+  // the delivered mark of its journal entry, if there is a journal, with a
+  // bit for each of the nicknames
+  unsigned int *delivered;
+  struct shared_message *shared;
+  unsigned short recipient;
+  unsigned short recipient_len;
+  // the whole target list, if the line went to several nicknames
+  unsigned short targets;
+  unsigned short targets_len;
+};
+
+// how many connections we allow unless told otherwise with -c. the open
+// file limit may allow fewer.
 #define MAX_CLIENTS 1024
-struct client_thread threads[MAX_CLIENTS];
+int max_clients=MAX_CLIENTS;
 
-// the number of connections we have open now
+// the number of connections we have open now. a connection takes its place
+// as soon as it is accepted, before anything is allocated for it, and gives
+// it back once its socket is closed.
 int connections_open=0;
 
+// how connections are serviced: one thread each, or a few epoll workers
+#define MODE_THREADS 0
+#define MODE_EPOLL 1
+#define MODE_URING 2
+int server_mode=MODE_THREADS;
+int reactor_count=0;
+
+// in reactor mode, give every worker a listening socket of its own on the
+// same port (SO_REUSEPORT) so that accepting is spread over all of them
+int reuseport=0;
+int listen_backlog=SOMAXCONN;
+
+// how long a registered client may be quiet (-i) before it is sent a PING,
+// and how much longer it then has to answer before it is disconnected.
+// a connection that has not registered gets REGISTRATION_TIMEOUT.
+#define IDLE_TIMEOUT 60
+#define REGISTRATION_TIMEOUT 5
+int idle_timeout=IDLE_TIMEOUT;
+
+// our name on a network of linked servers (-N), the servers we keep a
+// link to (-L host:port), and the password every link has to give (-P).
+// without a password nobody may link to us.
+#define MAX_LINK_PEERS 8
+char *server_name="ircserver.com";
+char *link_peers[MAX_LINK_PEERS];
+int link_peer_count=0;
+char *link_password=NULL;
+
+// how much output may wait for a connection that is slow to read it. past
+// that we disconnect it, or with sendq_drop throw away its oldest lines.
+#define SENDQ_DEFAULT (512*1024)
+long long sendq_limit=SENDQ_DEFAULT;
+int sendq_drop=0;
+
+// flood control: how many lines (-f) and bytes (-F) a second a client may
+// send, or 0 for no limit. a client may get up to FLOOD_BURST_MS ahead of
+// either rate; after that each line waits until it is within the limits
+// again, and nothing more is read from the client meanwhile. a client that
+// gets FLOOD_HELD_MAX bytes ahead is disconnected. links are not limited.
+#define FLOOD_BURST_MS 2000
+#define FLOOD_HELD_MAX (64*1024)
+int flood_lines=0;
+int flood_bytes=0;
+
+// latency tracing (-T n): about one PRIVMSG in n sent by each thread has
+// the time it reached each stage recorded, and STATS breaks the latency
+// down by stage. 0 turns it off.
+int trace_rate=0;
+
+// hot restart (-H): a reactor mode server listens on this unix socket for
+// the server that is to replace it, and hands that its listening sockets
+// and connections. handover_started is set once a successor has connected,
+// and stops every worker. an io_uring worker gives sends that are under
+// way HANDOVER_DRAIN_MS to finish; a connection still sending is left out.
+#define HANDOVER_DRAIN_MS 1000
+char *handover_path=NULL;
+int handover_started=0;
+
 pthread_rwlock_t message_log_lock = PTHREAD_RWLOCK_INITIALIZER;
 
+// with a journal, the newest private messages are also kept in the message
+// log, a ring of message_log_size slots, so that a restart knows what to
+// redeliver. message numbers keep counting up for the life of the server;
+// message n lives in slot n % message_log_size while
+// message_log_tail <= n < message_count.
 #define MAX_MESSAGES 10000
-char *message_log[MAX_MESSAGES];
-char *message_log_recipients[MAX_MESSAGES];
-char *message_log_senders[MAX_MESSAGES];
-int message_count=0;
-
-// returns error if message count is greater than specified max messages
-// appends message to the end of the message lock
-int message_log_append(char *sender, char *recipient, char *message) {
-  if (message_count>=MAX_MESSAGES) return -1;
-  pthread_rwlock_wrlock(&message_log_lock);
+int message_log_size=MAX_MESSAGES;
+struct log_record **message_log;
+long long message_log_tail=0;
+long long message_count=0;
 
-  //append the message here
-  message_log_recipients[message_count]=strdup(recipient);
-  message_log_senders[message_count]=strdup(sender);
-  message_log[message_count]=strdup(message);
-  message_count++;
+// nicknames in use, hashed by their RFC 2812 case-folded form. chains are
+// protected by a set of striped locks, so lookups of different nicknames
+// rarely contend with each other.
+#define NICK_BUCKETS 65536
+#define NICK_LOCKS 256
 
-  pthread_rwlock_unlock(&message_log_lock);
-  return 0;
-}
+struct client_thread *nick_table[NICK_BUCKETS];
+struct remote_user *remote_table[NICK_BUCKETS];
+pthread_mutex_t nick_locks[NICK_LOCKS];
 
-int message_log_read(struct client_thread *t) {
-  pthread_rwlock_rdlock(&message_log_lock);
+void nick_table_init(void) {
+  int i;
+  for(i=0;i<NICK_LOCKS;i++) pthread_mutex_init(&nick_locks[i],NULL);
+}
 
-  // read and process new messages in the log
-  // makes sure messages are unseen and meant for the user
+// copies nick into folded using the RFC 2812 casemapping, where {}|^ are
+// the lower case forms of []\~
+void nick_fold(char *folded,const char *nick) {
   int i;
-  for(i=t->next_message;i<message_count;i++){
-    if(!strcasecmp(message_log_recipients[i],t->nickname)) {
-      char msg[8192];
-      snprintf(msg,8192,":%s PRIVMSG %s :%s\n",message_log_senders[i],message_log_recipients[i],message_log[i]);
-      write(t->fd,msg,strlen(msg));
-    }
+  for(i=0;i<31&&nick[i];i++) {
+    char c=nick[i];
+    if (c>='A'&&c<='^') c+='a'-'A';
+    folded[i]=c;
   }
-  t->next_message=message_count;
+  folded[i]=0;
+}
 
-  pthread_rwlock_unlock(&message_log_lock);
-  return 0;
+unsigned int nick_hash(const char *folded) {
+  // FNV-1a
+  unsigned int h=2166136261u;
+  while(*folded) { h^=(unsigned char)*folded++; h*=16777619u; }
+  return h;
 }
 
-int read_from_socket(int sock,unsigned char *buffer,int *count,int buffer_size,
-		     int timeout)
-{
-  fcntl(sock,F_SETFL,fcntl(sock, F_GETFL, NULL)|O_NONBLOCK);
-
-  int t=time(0)+timeout;
-  if (*count>=buffer_size) return 0;
-  int r=read(sock,&buffer[*count],buffer_size-*count);
-  //NOSNOTE need count to be some value
-  while(r!=0) {
-    if (r>0) {
-      (*count)+=r;
-      break;
+pthread_mutex_t *nick_lock(unsigned int h) {
+  return &nick_locks[(h&(NICK_BUCKETS-1))%NICK_LOCKS];
+}
+
+// caller must hold the lock for h
+struct client_thread *nick_find_locked(const char *folded,unsigned int h) {
+  struct client_thread *t;
+  for(t=nick_table[h&(NICK_BUCKETS-1)];t;t=t->nick_next)
+    if (!strcmp(t->folded_nick,folded)) return t;
+  return NULL;
+}
+
+// caller must hold the lock for h
+struct remote_user *remote_find_locked(const char *folded,unsigned int h) {
+  struct remote_user *u;
+  for(u=remote_table[h&(NICK_BUCKETS-1)];u;u=u->nick_next)
+    if (!strcmp(u->folded_nick,folded)) return u;
+  return NULL;
+}
+
+// caller must hold the lock for the client's current nickname
+void nick_unlink_locked(struct client_thread *t) {
+  struct client_thread **p=&nick_table[nick_hash(t->folded_nick)&(NICK_BUCKETS-1)];
+  while(*p&&*p!=t) p=&(*p)->nick_next;
+  if (*p) *p=t->nick_next;
+  t->nick_next=NULL;
+}
+
+// takes nick for the client, giving up any nickname it had before.
+// returns -1 if someone else already has it, or it is empty.
+int nick_claim(struct client_thread *t,const char *nick) {
+  // an empty key could never be released again
+  if (!nick[0]) return -1;
+  char folded[32];
+  nick_fold(folded,nick);
+  unsigned int h=nick_hash(folded);
+
+  // always take the two locks in the same order
+  pthread_mutex_t *new_lock=nick_lock(h);
+  pthread_mutex_t *old_lock=t->folded_nick[0]?nick_lock(nick_hash(t->folded_nick)):new_lock;
+  pthread_mutex_t *first=new_lock<old_lock?new_lock:old_lock;
+  pthread_mutex_t *second=new_lock<old_lock?old_lock:new_lock;
+  pthread_mutex_lock(first);
+  if (second!=first) pthread_mutex_lock(second);
+
+  int r=0;
+  struct client_thread *owner=nick_find_locked(folded,h);
+  if ((owner&&owner!=t)||remote_find_locked(folded,h)) r=-1;
+  else {
+    if (!owner) {
+      if (t->folded_nick[0]) nick_unlink_locked(t);
+      strcpy(t->folded_nick,folded);
+      t->nick_next=nick_table[h&(NICK_BUCKETS-1)];
+      nick_table[h&(NICK_BUCKETS-1)]=t;
     }
-    r=read(sock,&buffer[*count],buffer_size-*count);
-    if (r==-1&&errno!=EAGAIN) {
-      perror("read() returned error. Stopping reading from socket.");
-      return -1;
-    } else usleep(100000);
-    // timeout after a few seconds of nothing
-    if (time(0)>=t) break;
+    strcpy(t->nickname,nick);
   }
-  buffer[*count]=0;
-  return 0;
+
+  if (second!=first) pthread_mutex_unlock(second);
+  pthread_mutex_unlock(first);
+  return r;
 }
 
-int create_listen_socket(int port)
-{
-  int sock = socket(AF_INET,SOCK_STREAM,0);
-  if (sock==-1) return -1;
+void nick_release(struct client_thread *t) {
+  if (!t->folded_nick[0]) return;
+  pthread_mutex_t *l=nick_lock(nick_hash(t->folded_nick));
+  pthread_mutex_lock(l);
+  nick_unlink_locked(t);
+  t->folded_nick[0]=0;
+  pthread_mutex_unlock(l);
+}
 
-  int on=1;
-  if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (char *)&on, sizeof(on)) == -1) {
-    close(sock); return -1;
+// counters for watching the server under load. every thread has its own
+// set, which only it writes, so counting costs no locked instructions;
+// STATS and the SIGUSR1 dump add them all up when asked. delivery latency
+// is kept as a histogram of powers of two microseconds.
+#define STATS_BUCKETS 24
+
+struct stats {
+  long long appended;
+  long long delivered;
+  long long bytes_in;
+  long long bytes_out;
+  long long parse_errors;
+  // times message_log_lock was busy when we wanted it, and how long we
+  // waited for it in total
+  long long lock_waits;
+  long long lock_wait_ns;
+  // lines thrown away, and connections closed, for overflowing the sendq
+  long long sendq_drops;
+  long long sendq_kills;
+  // lines made to wait, and connections closed, by flood control
+  long long flood_waits;
+  long long flood_kills;
+  // connections turned away for being over the limit
+  long long rejected;
+  // reads, writes, waits and wakeups on the path messages take
+  long long syscalls;
+  long long latency[STATS_BUCKETS];
+  // this thread's ring of trace events, and how many it has recorded
+  struct trace_event *trace;
+  unsigned long long trace_head;
+  struct stats *next;
+};
+
+pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+struct stats *all_stats=NULL;
+// what threads that have exited had counted
+struct stats retired_stats;
+pthread_key_t stats_key;
+__thread struct stats *thread_stats=NULL;
+
+long long clock_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec*1000000000LL+ts.tv_nsec;
+}
+
+long long stat_get(long long *counter) {
+  return __atomic_load_n(counter,__ATOMIC_RELAXED);
+}
+
+void stats_add_all(struct stats *total,struct stats *s) {
+  total->appended+=stat_get(&s->appended);
+  total->delivered+=stat_get(&s->delivered);
+  total->bytes_in+=stat_get(&s->bytes_in);
+  total->bytes_out+=stat_get(&s->bytes_out);
+  total->parse_errors+=stat_get(&s->parse_errors);
+  total->lock_waits+=stat_get(&s->lock_waits);
+  total->lock_wait_ns+=stat_get(&s->lock_wait_ns);
+  total->sendq_drops+=stat_get(&s->sendq_drops);
+  total->sendq_kills+=stat_get(&s->sendq_kills);
+  total->flood_waits+=stat_get(&s->flood_waits);
+  total->flood_kills+=stat_get(&s->flood_kills);
+  total->rejected+=stat_get(&s->rejected);
+  total->syscalls+=stat_get(&s->syscalls);
+  int b;
+  for(b=0;b<STATS_BUCKETS;b++) total->latency[b]+=stat_get(&s->latency[b]);
+}
+
+// runs as each thread that has counted anything exits
+void stats_retire(void *data) {
+  struct stats *s=data;
+  pthread_mutex_lock(&stats_lock);
+  struct stats **p=&all_stats;
+  while(*p!=s) p=&(*p)->next;
+  *p=s->next;
+  stats_add_all(&retired_stats,s);
+  pthread_mutex_unlock(&stats_lock);
+  free(s->trace);
+  free(s);
+}
+
+void stats_init(void) {
+  pthread_key_create(&stats_key,stats_retire);
+}
+
+struct stats *stats(void) {
+  if (thread_stats) return thread_stats;
+  static struct stats spare;
+  struct stats *s=calloc(sizeof(struct stats),1);
+  // count somewhere rather than not at all
+  if (!s) return &spare;
+  pthread_mutex_lock(&stats_lock);
+  s->next=all_stats;
+  all_stats=s;
+  pthread_mutex_unlock(&stats_lock);
+  pthread_setspecific(stats_key,s);
+  thread_stats=s;
+  return s;
+}
+
+// only the owning thread writes a counter, so this need not be atomic; the
+// store just has to be a whole one for whoever adds the counters up
+void stat_add(long long *counter,long long n) {
+  __atomic_store_n(counter,*counter+n,__ATOMIC_RELAXED);
+}
+
+int latency_bucket(long long ns) {
+  long long us=ns/1000;
+  int b=0;
+  while(b<STATS_BUCKETS-1&&us>=(1LL<<b)) b++;
+  return b;
+}
+
+void stat_latency(struct stats *s,long long ns) {
+  stat_add(&s->latency[latency_bucket(ns)],1);
+}
+
+void stats_total(struct stats *total) {
+  memset(total,0,sizeof(struct stats));
+  pthread_mutex_lock(&stats_lock);
+  stats_add_all(total,&retired_stats);
+  struct stats *s;
+  for(s=all_stats;s;s=s->next) stats_add_all(total,s);
+  pthread_mutex_unlock(&stats_lock);
+}
+
+// upper bound in microseconds of the bucket holding the given fraction
+// of the latencies in a histogram
+long long histogram_percentile(long long *latency,double p) {
+  long long count=0,seen=0;
+  int b;
+  for(b=0;b<STATS_BUCKETS;b++) count+=latency[b];
+  if (!count) return 0;
+  for(b=0;b<STATS_BUCKETS-1;b++) {
+    seen+=latency[b];
+    if (seen>=p*count) break;
   }
-  if (ioctl(sock, FIONBIO, (char *)&on) == -1) {
-    close(sock); return -1;
+  return 1LL<<b;
+}
+
+long long stats_percentile(struct stats *total,double p) {
+  return histogram_percentile(total->latency,p);
+}
+
+void stat_syscall(void) {
+  stat_add(&stats()->syscalls,1);
+}
+
+// a traced line's times: a sender records when it was read, parsed, had
+// the locks it needed and had queued it to everyone; each recipient
+// records when it was read, queued to them, moved to their output and
+// written out. a line counts as read once its end has arrived, and as
+// written once the socket has taken it, which with io_uring is when its
+// sendmsg completes. each thread keeps the newest TRACE_RING events it has
+// recorded in a ring that only it writes.
+#define TRACE_RING 1024
+#define TRACE_SEND 0
+#define TRACE_DELIVERY 1
+#define TRACE_STAGES 6
+
+struct trace_event {
+  int kind;
+  long long at[4];
+};
+
+char *trace_stages[TRACE_STAGES]={
+  "read to parsed","parsed to locked","locked to queued",
+  "queued to delivered","delivered to written","read to written"
+};
+
+// when the line being handled was read, and when the PRIVMSG being sent
+// was read and parsed if it is being traced
+__thread long long trace_input=0;
+__thread long long trace_read=0;
+__thread long long trace_parsed=0;
+__thread int trace_count=0;
+// the first traced mail moved to the output since it was last written
+__thread struct trace_event trace_delivery;
+
+void trace_record(int kind,long long read,long long a,long long b,long long c) {
+  struct stats *s=stats();
+  if (!s->trace) {
+    struct trace_event *ring=calloc(TRACE_RING,sizeof(struct trace_event));
+    if (!ring) return;
+    __atomic_store_n(&s->trace,ring,__ATOMIC_RELEASE);
   }
-  
-  /* Bind it to the next port we want to try. */
-  struct sockaddr_in address;
-  bzero((char *) &address, sizeof(address));
-  address.sin_family = AF_INET;
-  address.sin_addr.s_addr = INADDR_ANY;
-  address.sin_port = htons(port);
-  if (bind(sock, (struct sockaddr *) &address, sizeof(address)) == -1) {
-    close(sock); return -1;
-  } 
+  struct trace_event *e=&s->trace[s->trace_head%TRACE_RING];
+  e->kind=kind;
+  e->at[0]=read;
+  e->at[1]=a;
+  e->at[2]=b;
+  e->at[3]=c;
+  __atomic_store_n(&s->trace_head,s->trace_head+1,__ATOMIC_RELEASE);
+}
 
-  if (listen(sock, 20) != -1) return sock;
+// decides whether the PRIVMSG about to be sent is traced
+void trace_begin(void) {
+  if (!trace_rate||!trace_input||++trace_count<trace_rate) return;
+  trace_count=0;
+  trace_read=trace_input;
+  trace_parsed=clock_ns();
+}
 
-  close(sock);
-  return -1;
+// adds up the latency of each stage over the events in every thread's
+// ring, and returns how many events there were
+long long trace_histograms(long long latency[TRACE_STAGES][STATS_BUCKETS]) {
+  memset(latency,0,TRACE_STAGES*STATS_BUCKETS*sizeof(long long));
+  struct trace_event *copy=malloc(TRACE_RING*sizeof(struct trace_event));
+  if (!copy) return 0;
+  long long count=0;
+  pthread_mutex_lock(&stats_lock);
+  struct stats *s;
+  for(s=all_stats;s;s=s->next) {
+    struct trace_event *ring=__atomic_load_n(&s->trace,__ATOMIC_ACQUIRE);
+    if (!ring) continue;
+    unsigned long long head=__atomic_load_n(&s->trace_head,__ATOMIC_ACQUIRE);
+    unsigned long long first=head>TRACE_RING?head-TRACE_RING:0,n;
+    for(n=first;n<head;n++) copy[n%TRACE_RING]=ring[n%TRACE_RING];
+    // the owner may have written over the oldest meanwhile
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    unsigned long long now=__atomic_load_n(&s->trace_head,__ATOMIC_ACQUIRE);
+    if (now>=TRACE_RING&&now-TRACE_RING+1>first) first=now-TRACE_RING+1;
+    for(n=first;n<head;n++) {
+      struct trace_event *e=&copy[n%TRACE_RING];
+      int stage=e->kind==TRACE_SEND?0:3,i;
+      for(i=0;i<(e->kind==TRACE_SEND?3:2);i++)
+        latency[stage+i][latency_bucket(e->at[i+1]-e->at[i])]++;
+      if (e->kind==TRACE_DELIVERY) latency[5][latency_bucket(e->at[3]-e->at[0])]++;
+      count++;
+    }
+  }
+  pthread_mutex_unlock(&stats_lock);
+  free(copy);
+  return count;
 }
 
-int accept_incoming(int sock)
-{
-  struct sockaddr addr;
-  unsigned int addr_len = sizeof addr;
-  int asock;
-  if ((asock = accept(sock, &addr, &addr_len)) != -1) {
-    return asock;
+// takes message_log_lock, counting how long we wait if someone has it
+void message_log_lock_wait(int write) {
+  int r=write?pthread_rwlock_trywrlock(&message_log_lock):pthread_rwlock_tryrdlock(&message_log_lock);
+  if (!r) return;
+  long long start=clock_ns();
+  if (write) pthread_rwlock_wrlock(&message_log_lock);
+  else pthread_rwlock_rdlock(&message_log_lock);
+  struct stats *s=stats();
+  stat_add(&s->lock_waits,1);
+  stat_add(&s->lock_wait_ns,clock_ns()-start);
+}
+
+// fixed size objects are carved out of 64KB chunks, aligned to their size
+// so that an object's chunk can be found from its address. a chunk goes
+// back to the system once everything in it has been freed, except for one
+// kept spare so that a client coming and going does not map and unmap.
+#define SLAB_CHUNK 65536
+
+struct slab_chunk {
+  struct slab *slab;
+  // place in the slab's list of chunks with free objects
+  struct slab_chunk *prev,*next;
+  void *free;
+  int used;
+};
+
+struct slab {
+  int size;
+  pthread_mutex_t lock;
+  struct slab_chunk *partial;
+  int partial_count;
+  // chunks mapped, for STATS, which reads it without the lock
+  int chunks;
+};
+
+#define SLAB_INIT(size) { ((size)+15)&~15, PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0 }
+
+// maps a chunk aligned to SLAB_CHUNK by mapping twice as much and
+// trimming off the ends
+struct slab_chunk *slab_chunk_new(struct slab *s) {
+  char *p=mmap(NULL,SLAB_CHUNK*2,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+  if (p==MAP_FAILED) return NULL;
+  char *start=(char *)(((uintptr_t)p+SLAB_CHUNK-1)&~(uintptr_t)(SLAB_CHUNK-1));
+  if (start>p) munmap(p,start-p);
+  munmap(start+SLAB_CHUNK,p+SLAB_CHUNK*2-(start+SLAB_CHUNK));
+
+  struct slab_chunk *c=(struct slab_chunk *)start;
+  c->slab=s;
+  c->prev=c->next=NULL;
+  c->free=NULL;
+  c->used=0;
+  char *o=start+((sizeof(struct slab_chunk)+15)&~15);
+  for(;o+s->size<=start+SLAB_CHUNK;o+=s->size) {
+    *(void **)o=c->free;
+    c->free=o;
   }
+  return c;
+}
 
-  return -1;
+void slab_unlink(struct slab *s,struct slab_chunk *c) {
+  if (c->prev) c->prev->next=c->next; else s->partial=c->next;
+  if (c->next) c->next->prev=c->prev;
+  c->prev=c->next=NULL;
+  s->partial_count--;
 }
 
-int parse_line(struct client_thread *t, char *buffer) {
-  char msg[1024];
-  char channel[8192];
-  char nickname[8192];
-  
-  if (!strncasecmp("QUIT",buffer,4)) {
-    // client has said they are going away
-    // if we dont close the connection, we will get a SIGPIPE that will kill our program
-    // when we try to read from the socket again in the loop.
-    snprintf(msg,1024,"ERROR :Closing Link: User quit\n");
-    write(t->fd,msg,strlen(msg));
-    close(t->fd);
-    connections_open--;
-    return -1;
+void slab_link(struct slab *s,struct slab_chunk *c) {
+  c->prev=NULL;
+  c->next=s->partial;
+  if (s->partial) s->partial->prev=c;
+  s->partial=c;
+  s->partial_count++;
+}
+
+// caller must hold the slab's lock
+void *slab_take(struct slab *s) {
+  struct slab_chunk *c=s->partial;
+  if (!c) {
+    c=slab_chunk_new(s);
+    if (!c) return NULL;
+    slab_link(s,c);
+    __atomic_add_fetch(&s->chunks,1,__ATOMIC_RELAXED);
   }
+  void *o=c->free;
+  c->free=*(void **)o;
+  c->used++;
+  if (!c->free) slab_unlink(s,c);
+  return o;
+}
 
-  // if user has not registered, return error
-  if (!strncasecmp("PRIVMSG",buffer,7)) {
-    if(!t->user_has_registered) {
-      snprintf(msg,1024,":ircserver.com 241 * : PRIVMSG command sent before registration\n");
-      write(t->fd,msg,strlen(msg));
-      return 0;
-    } else {
-      // accept and process PRIVMSG
-      char recipient[1024];
-      char message[1024];
-      char sender[1024];
-      if (sscanf(buffer, "PRIVMSG %s :%[^\n]",recipient,message)==2) {
-          snprintf(sender,1024,"%s!myusername@myserver",t->nickname);
-          message_log_append(sender,recipient,message);
-      } else {
-        // malformed PRIVMSG command returns error
-        snprintf(msg,1024,":ircserver.com 461 %s : Mal-formed PRIVMSG command sent\n",t->nickname);
-        write(t->fd,msg,strlen(msg));
-        return 0;
-      }
-    }
+// caller must hold the slab's lock
+void slab_put(struct slab *s,void *o) {
+  struct slab_chunk *c=(struct slab_chunk *)((uintptr_t)o&~(uintptr_t)(SLAB_CHUNK-1));
+  if (!c->free) slab_link(s,c);
+  *(void **)o=c->free;
+  c->free=o;
+  c->used--;
+  if (!c->used&&s->partial_count>1) {
+    slab_unlink(s,c);
+    munmap(c,SLAB_CHUNK);
+    __atomic_sub_fetch(&s->chunks,1,__ATOMIC_RELAXED);
   }
+}
 
-  // if user has not registerd, returns an error
-  // else, connects user to channel
-  int r=sscanf((char *)buffer,"JOIN %s",channel);   
-  if(r==1) {
-    if(!t->user_has_registered) {
-      snprintf(msg,1024,":ircserver.com 241 * : JOIN command sent before registration\n");
-      write(t->fd,msg,strlen(msg));
-      return 0;
-    } else {
-      //join channel code
-    }
+// returns uninitialised memory, or NULL if we are out of it
+void *slab_alloc(struct slab *s) {
+  pthread_mutex_lock(&s->lock);
+  void *o=slab_take(s);
+  pthread_mutex_unlock(&s->lock);
+  return o;
+}
+
+void slab_free(void *o) {
+  struct slab *s=((struct slab_chunk *)((uintptr_t)o&~(uintptr_t)(SLAB_CHUNK-1)))->slab;
+  pthread_mutex_lock(&s->lock);
+  slab_put(s,o);
+  pthread_mutex_unlock(&s->lock);
+}
+
+// variable length records (log entries, shared lines, mail) come from a
+// slab of the smallest size class that fits them. anything bigger than the
+// largest class is left to malloc. the caller says how big a record was
+// when it frees it, so nothing needs to be stored alongside.
+// records are mostly freed by a different thread from the one that made
+// them, so each thread keeps a list of spares of each class, and moves a
+// batch at a time to or from the slab under one taking of its lock. a batch
+// is POOL_BATCH records, or POOL_BATCH_BYTES of the bigger ones, so that in
+// thread mode every connection's thread is not sitting on spare buffers.
+#define POOL_CLASSES 6
+#define POOL_BATCH 32
+#define POOL_BATCH_BYTES 2048
+struct slab pool_slabs[POOL_CLASSES]={
+  SLAB_INIT(64),SLAB_INIT(128),SLAB_INIT(256),SLAB_INIT(512),SLAB_INIT(1024),SLAB_INIT(2048)
+};
+
+struct pool_cache {
+  void *free;
+  int count;
+};
+
+__thread struct pool_cache pool_caches[POOL_CLASSES];
+__thread int pool_cached=0;
+pthread_key_t pool_key;
+
+int pool_class(int size) {
+  int i;
+  for(i=0;i<POOL_CLASSES;i++) if (size<=pool_slabs[i].size) return i;
+  return -1;
+}
+
+int pool_batch(int i) {
+  int n=POOL_BATCH_BYTES/pool_slabs[i].size;
+  return n<1?1:n>POOL_BATCH?POOL_BATCH:n;
+}
+
+// gives back the first n spares of a class
+void pool_drain(int i,int n) {
+  struct pool_cache *c=&pool_caches[i];
+  pthread_mutex_lock(&pool_slabs[i].lock);
+  while(c->free&&n--) {
+    void *o=c->free;
+    c->free=*(void **)o;
+    c->count--;
+    slab_put(&pool_slabs[i],o);
   }
+  pthread_mutex_unlock(&pool_slabs[i].lock);
+}
 
-  int n=sscanf((char *)buffer,"NICK %s",nickname);
-  if(n) {
-    if (strlen(nickname)<=32) {
-    strcpy(t->nickname,nickname);
-    registration_check(t);
-    } else {
-      snprintf(msg,1024,":ircserver.com 432 : Nickname too long\n");
-      write(t->fd,msg,strlen(msg));       
+// runs as each thread that has kept spares exits
+void pool_retire(void *data) {
+  int i;
+  for(i=0;i<POOL_CLASSES;i++) pool_drain(i,pool_caches[i].count);
+}
+
+void pool_init(void) {
+  pthread_key_create(&pool_key,pool_retire);
+}
+
+// makes sure our spares go back when this thread exits
+void pool_cache_claim(void) {
+  if (pool_cached) return;
+  pthread_setspecific(pool_key,pool_caches);
+  pool_cached=1;
+}
+
+void *pool_alloc(int size) {
+  int i=pool_class(size);
+  if (i<0) return malloc(size);
+  struct pool_cache *c=&pool_caches[i];
+  if (!c->free) {
+    pool_cache_claim();
+    pthread_mutex_lock(&pool_slabs[i].lock);
+    while(c->count<pool_batch(i)) {
+      void *o=slab_take(&pool_slabs[i]);
+      if (!o) break;
+      *(void **)o=c->free;
+      c->free=o;
+      c->count++;
     }
+    pthread_mutex_unlock(&pool_slabs[i].lock);
+    if (!c->free) return NULL;
   }
+  void *o=c->free;
+  c->free=*(void **)o;
+  c->count--;
+  return o;
+}
 
-  int u=sscanf((char *)buffer,"USER %s",channel);
-  if(u==1) {
-    t->user_command_seen=1;
-    registration_check(t);
+void pool_free(void *p,int size) {
+  if (!p) return;
+  int i=pool_class(size);
+  if (i<0) {
+    free(p);
+    return;
   }
-  return 0;
+  pool_cache_claim();
+  struct pool_cache *c=&pool_caches[i];
+  *(void **)p=c->free;
+  c->free=p;
+  c->count++;
+  if (c->count>=pool_batch(i)*2) pool_drain(i,pool_batch(i));
 }
 
+// moves a record of old_size bytes to one of size bytes, keeping what fits
+void *pool_realloc(void *p,int old_size,int size) {
+  if (!p) return pool_alloc(size);
+  int i=pool_class(size);
+  if (i<0&&pool_class(old_size)<0) return realloc(p,size);
+  if (i>=0&&i==pool_class(old_size)) return p;
+  void *n=pool_alloc(size);
+  if (!n) return NULL;
+  memcpy(n,p,old_size<size?old_size:size);
+  pool_free(p,old_size);
+  return n;
+}
 
-// makes sure that the connections open is not greater than the maximum clients
-// then proceeds to connection code
-void *handle_connection(void *data) {
-  struct client_thread *t=data;
-  if(++connections_open>MAX_CLIENTS) {
-    char msg[1024];
-    snprintf(msg,1024,"ERROR :Closing Link: Client count too great\n");
-    write(t->fd,msg,strlen(msg));
-    close(t->fd);
-    connections_open--;
+// connections come from their own slab
+struct slab client_slab=SLAB_INIT(sizeof(struct client_thread));
+
+void client_line_release(struct client_thread *t) {
+  pool_free(t->line,LINE_SIZE);
+  t->line=NULL;
+  t->line_len=0;
+}
+
+void inbox_init(struct inbox *q);
+
+struct client_thread *client_new(int fd) {
+  struct client_thread *t=slab_alloc(&client_slab);
+  if (!t) return NULL;
+  memset(t,0,sizeof(struct client_thread));
+  t->fd=fd;
+  inbox_init(&t->inbox);
+  return t;
+}
+
+struct shared_message *shared_message_new(const char *line) {
+  int len=strlen(line);
+  struct shared_message *sm=pool_alloc(sizeof(struct shared_message)+len+1);
+  if (!sm) return NULL;
+  sm->refs=1;
+  sm->len=len;
+  memcpy(sm->data,line,len+1);
+  return sm;
+}
+
+// ":sender PRIVMSG recipient :text\n", put together from pieces whose
+// lengths we already know
+struct shared_message *shared_message_privmsg(const char *sender,int sender_len,
+    const char *recipient,int recipient_len,const char *text,int text_len) {
+  int len=1+sender_len+9+recipient_len+2+text_len+1;
+  struct shared_message *sm=pool_alloc(sizeof(struct shared_message)+len+1);
+  if (!sm) return NULL;
+  sm->refs=1;
+  sm->len=len;
+  char *p=sm->data;
+  *p++=':';
+  memcpy(p,sender,sender_len); p+=sender_len;
+  memcpy(p," PRIVMSG ",9); p+=9;
+  memcpy(p,recipient,recipient_len); p+=recipient_len;
+  memcpy(p," :",2); p+=2;
+  memcpy(p,text,text_len); p+=text_len;
+  *p++='\n';
+  *p=0;
+  return sm;
+}
+
+void shared_message_release(struct shared_message *sm) {
+  if (__atomic_sub_fetch(&sm->refs,1,__ATOMIC_ACQ_REL)==0)
+    pool_free(sm,sizeof(struct shared_message)+sm->len+1);
+}
+
+// mail for a shared line, taking a reference to it
+struct mail *mail_new(struct shared_message *shared,long long queued) {
+  struct mail *m=pool_alloc(sizeof(struct mail));
+  if (!m) return NULL;
+  m->shared=shared;
+  m->targets_len=0;
+  m->delivered=NULL;
+  m->message=-1;
+  m->queued=queued;
+  m->traced=0;
+  m->epoch=0;
+  __atomic_add_fetch(&shared->refs,1,__ATOMIC_RELAXED);
+  return m;
+}
+
+// sends the mail's recipient only their own part of the target list
+void mail_cut(struct mail *m,int targets,int targets_len,int recipient,int recipient_len) {
+  if (targets_len==recipient_len) return;
+  m->targets=targets;
+  m->targets_len=targets_len;
+  m->recipient=recipient;
+  m->recipient_len=recipient_len;
+}
+
+void inbox_init(struct inbox *q) {
+  q->stub.next=NULL;
+  q->head=q->tail=&q->stub;
+}
+
+// any thread may push
+void inbox_push(struct inbox *q,struct mail *m) {
+  m->next=NULL;
+  struct mail *prev=__atomic_exchange_n(&q->head,m,__ATOMIC_ACQ_REL);
+  // until this store the reader sees the queue end at prev
+  __atomic_store_n(&prev->next,m,__ATOMIC_RELEASE);
+}
+
+// only the owner may pop. returns NULL when the inbox is empty, or when the
+// next mail is still being pushed; its sender will notify us once it is in.
+struct mail *inbox_pop(struct inbox *q) {
+  struct mail *tail=q->tail;
+  struct mail *next=__atomic_load_n(&tail->next,__ATOMIC_ACQUIRE);
+  if (tail==&q->stub) {
+    if (!next) return NULL;
+    q->tail=next;
+    tail=next;
+    next=__atomic_load_n(&tail->next,__ATOMIC_ACQUIRE);
   }
-  connection(t);
-  return 0;
+  if (next) {
+    q->tail=next;
+    return tail;
+  }
+  if (tail!=__atomic_load_n(&q->head,__ATOMIC_ACQUIRE)) return NULL;
+  // tail is the last one, so put the stub behind it before taking it
+  inbox_push(q,&q->stub);
+  next=__atomic_load_n(&tail->next,__ATOMIC_ACQUIRE);
+  if (!next) return NULL;
+  q->tail=next;
+  return tail;
 }
 
-int connection(struct client_thread *t) {
-  int fd=t->fd;
-  t->timeout=5;
-  t->next_message=message_count;
-  unsigned char buffer[8192];
-  int length=0;
-  char msg[1024];
+void inbox_free_mail(struct mail *m) {
+  shared_message_release(m->shared);
+  pool_free(m,sizeof(struct mail));
+}
 
-  snprintf(msg,1024,":ircserver.com 020 * :gday m8\n");
-  write(fd,msg,strlen(msg));
+// caller must make sure nobody can push any more
+void inbox_free(struct inbox *q) {
+  struct mail *m;
+  while((m=inbox_pop(q))) inbox_free_mail(m);
+}
 
-  int time_of_last_data=time(0);
+void reactor_notify(struct client_thread *t);
 
-  // should test for t->fd>=0 instead of 1
-  while(1){
-    length=0;
-    // checks for messages for user in log
-    message_log_read(t);
-  	read_from_socket(fd,buffer,&length,8192,1);
-    buffer[length]=0;
-    if(length>0) time_of_last_data=time(0);
-    // if time since last command is greater or equal to the timeout, close connection
-    if(!length && (time(0)-time_of_last_data)>=t->timeout){
-  	  snprintf(msg,1024,"ERROR :Closing Link: Connection timed out length=0\n");
-  	  write(fd,msg,strlen(msg));
-  	  close(fd);
-      connections_open--;
-  	  return 0;
-  	}
-    // parse each character of the line
-    int i;
-    for(i=0;i<length;i++) {
-      // checks if there is a newline or return character
-      if(buffer[i]=='\n'||buffer[i]=='\r'){
-        // if there is a newline or return character, parse the line
-        // checks if the line closes the connection, then exit the function
-        // finally resets the line and linelength variables
-        if(t->line_len>0 && parse_line(t,t->line)==-1)return 0;
-        t->line_len=0;
-        bzero(t->line,1024);
-      } else {
-        if (t->line_len<1024) {
-          t->line[t->line_len++]=buffer[i];
-          t->line[t->line_len]=0;
-        }
-      }
-    }
-    // if there are remaining bytes, parse the line
-    // if the socket is closed, exit function
-    if (t->line_len>0 && parse_line(t,(char *)buffer)==-1) return 0;
+// wakes a connection up to read its inbox, unless it has been woken and
+// not looked yet. the caller must stop the connection going away meanwhile,
+// e.g. by holding the lock on its nickname, or channels_lock.
+void client_notify(struct client_thread *t) {
+  if (__atomic_exchange_n(&t->wake_pending,1,__ATOMIC_SEQ_CST)) return;
+  if (t->reactor) reactor_notify(t);
+  else {
+    uint64_t v=1;
+    stat_syscall();
+    write(t->wakefd,&v,sizeof(v));
   }
-  close(fd);
+}
+
+// how many segments go to writev at once. a connection's output buffer and
+// segments come from the pool and go back as soon as everything in them has
+// been sent, so a quiet connection holds neither.
+#define OUTPUT_IOVECS 64
+#define OUTPUT_BUF_MIN 1024
+
+// makes room for n more segments
+int output_reserve(struct output *o,int n) {
+  if (o->count+n<=o->size) return 0;
+  int size=o->size?o->size*2:8;
+  while(size<o->count+n) size*=2;
+  struct output_segment *segments=pool_realloc(o->segments,o->size*sizeof(struct output_segment),
+                                               size*sizeof(struct output_segment));
+  if (!segments) return -1;
+  o->segments=segments;
+  o->size=size;
   return 0;
 }
 
-// checks if the user has sent both USER and NICK commands
-// then sends user confirmation of connection
-int registration_check(struct client_thread *t) 
-{
-  if (t->user_has_registered) return -1;
-  if (t->user_command_seen&&t->nickname[0]) {
-    // User has now met the registration requirements
-    t->user_has_registered=1;
-    t->timeout=60;
-    char msg[1024];
-    snprintf(msg,1024,":ircserver.com 001 %s : Gday\n",t->nickname);
-    write(t->fd,msg,strlen(msg));
-    snprintf(msg,1024,":ircserver.com 002 %s : mate.\n",t->nickname);
-    write(t->fd,msg,strlen(msg));
-    snprintf(msg,1024,":ircserver.com 003 %s : Welcome\n",t->nickname);
-    write(t->fd,msg,strlen(msg));
-    snprintf(msg,1024,":ircserver.com 004 %s : to the server.\n",t->nickname);
-    write(t->fd,msg,strlen(msg));
-    snprintf(msg,1024,":ircserver.com 253 %s : some unknown connections\n",t->nickname);
-    write(t->fd,msg,strlen(msg));
-    snprintf(msg,1024,":ircserver.com 254 %s : some channels formed.\n",t->nickname);
-    write(t->fd,msg,strlen(msg));
-    snprintf(msg,1024,":ircserver.com 255 %s : I have %i clients and some servers.\n",t->nickname,connections_open);
-    write(t->fd,msg,strlen(msg));
-    return 0;
+// moves our own queued bytes down to the front of the buffer, so that a
+// connection that never quite catches up does not keep growing it
+void output_compact(struct output *o) {
+  int i,len=0;
+  for(i=0;i<o->count;i++) {
+    struct output_segment *s=&o->segments[i];
+    if (s->shared) continue;
+    if (s->offset!=len) memmove(&o->buf[len],&o->buf[s->offset],s->len);
+    s->offset=len;
+    len+=s->len;
   }
-  return -1;
+  o->buf_len=len;
 }
 
-int main(int argc,char **argv) {
-  signal(SIGPIPE, SIG_IGN);
+// gives the buffer and segments of an output that has nothing queued back
+// to the pool
+void output_release(struct output *o) {
+  pool_free(o->segments,o->size*sizeof(struct output_segment));
+  pool_free(o->buf,o->buf_size);
+  o->segments=NULL;
+  o->size=0;
+  o->buf=NULL;
+  o->buf_size=0;
+  o->buf_len=0;
+}
 
-  if (argc!=2) {
-  fprintf(stderr,"usage: sample <tcp port>\n");
-  exit(-1);
+int output_add(struct output *o,struct shared_message *shared,int offset,int len) {
+  // our own bytes usually follow on from the last lot, so just extend it
+  if (!shared&&o->count) {
+    struct output_segment *last=&o->segments[o->count-1];
+    if (!last->shared&&last->offset+last->len==offset) {
+      last->len+=len;
+      o->queued+=len;
+      return 0;
+    }
   }
-  
-  int master_socket = create_listen_socket(atoi(argv[1]));
-  
-  fcntl(master_socket,F_SETFL,fcntl(master_socket, F_GETFL, NULL)&(~O_NONBLOCK));  
-  // allocates memory for an array of structs
-  // creates thread for the handle connection function
+  if (output_reserve(o,1)) return -1;
+  o->segments[o->count].shared=shared;
+  o->segments[o->count].offset=offset;
+  o->segments[o->count].len=len;
+  o->count++;
+  o->queued+=len;
+  return 0;
+}
+
+// formats a reply onto the end of the connection's output
+int output_printf(struct client_thread *t,const char *fmt,...) {
+  struct output *o=&t->output;
+  va_list ap;
   while(1) {
-    int client_sock = accept_incoming(master_socket);
-    if (client_sock!=-1) {
-      struct client_thread *t=calloc(sizeof(struct client_thread),1);
-      if(t!=NULL){
-        t->fd=client_sock;
-        int err = pthread_create(&t->thread,NULL,handle_connection,(void*)t);
-        if (err) close(client_sock);
+    int space=o->buf_size-o->buf_len;
+    va_start(ap,fmt);
+    int len=vsnprintf(o->buf?&o->buf[o->buf_len]:NULL,space,fmt,ap);
+    va_end(ap);
+    if (len<0) return -1;
+    if (len<space) {
+      if (output_add(o,NULL,o->buf_len,len)) return -1;
+      o->buf_len+=len;
+      return len;
+    }
+    // pack down what is still queued before growing the buffer
+    if (o->buf_len) {
+      int before=o->buf_len;
+      output_compact(o);
+      if (o->buf_len<before&&len<o->buf_size-o->buf_len) continue;
+    }
+    int size=o->buf_size?o->buf_size:OUTPUT_BUF_MIN;
+    while(size<=o->buf_len+len) size*=2;
+    char *buf=pool_realloc(o->buf,o->buf_size,size);
+    if (!buf) return -1;
+    o->buf=buf;
+    o->buf_size=size;
+  }
+}
+
+int output_append(struct client_thread *t,const char *data,int len) {
+  struct output *o=&t->output;
+  if (o->buf_len+len>o->buf_size) output_compact(o);
+  if (o->buf_len+len>o->buf_size) {
+    int size=o->buf_size?o->buf_size:OUTPUT_BUF_MIN;
+    while(size<o->buf_len+len) size*=2;
+    char *buf=pool_realloc(o->buf,o->buf_size,size);
+    if (!buf) return -1;
+    o->buf=buf;
+    o->buf_size=size;
+  }
+  memcpy(&o->buf[o->buf_len],data,len);
+  if (output_add(o,NULL,o->buf_len,len)) return -1;
+  o->buf_len+=len;
+  return 0;
+}
+
+// queues a shared line without copying it. the caller's reference passes
+// to the output, and is dropped once the line has been written.
+int output_shared(struct client_thread *t,struct shared_message *sm) {
+  if (output_add(&t->output,sm,0,sm->len)) {
+    shared_message_release(sm);
+    return -1;
+  }
+  return 0;
+}
+
+// queues a mail's line, cut down to its recipient if it went to several
+// nicknames. every piece holds a reference of its own, so the mail's
+// reference passes to the output as with output_shared.
+int output_mail(struct client_thread *t,struct mail *m) {
+  struct shared_message *sm=m->shared;
+  if (!m->targets_len) return output_shared(t,sm);
+  // room for all three pieces first, so it is never left half queued
+  struct output *o=&t->output;
+  if (output_reserve(o,3)) {
+    shared_message_release(sm);
+    return -1;
+  }
+  __atomic_add_fetch(&sm->refs,2,__ATOMIC_RELAXED);
+  int rest=m->targets+m->targets_len;
+  output_add(o,sm,0,m->targets);
+  output_add(o,sm,m->recipient,m->recipient_len);
+  output_add(o,sm,rest,sm->len-rest);
+  return 0;
+}
+
+int uring_flush(struct client_thread *t);
+void uring_trace(struct client_thread *t,struct trace_event *e);
+
+// writes as much queued output as the socket will take. anything left over
+// stays queued for next time. returns -1 if the connection is broken.
+int output_flush(struct client_thread *t) {
+  if (t->uring) return uring_flush(t);
+  struct output *o=&t->output;
+  while(o->count) {
+    struct iovec iov[OUTPUT_IOVECS];
+    int n;
+    for(n=0;n<o->count&&n<OUTPUT_IOVECS;n++) {
+      struct output_segment *s=&o->segments[n];
+      iov[n].iov_base=(s->shared?s->shared->data:o->buf)+s->offset;
+      iov[n].iov_len=s->len;
+    }
+    stat_syscall();
+    ssize_t w=writev(t->fd,iov,n);
+    if (w==-1) {
+      if (errno==EINTR) continue;
+      if (errno==EAGAIN||errno==EWOULDBLOCK) return 0;
+      return -1;
+    }
+    stat_add(&stats()->bytes_out,w);
+    o->queued-=w;
+
+    // drop whatever was written completely, and trim what was written in part
+    int done=0;
+    while(done<o->count&&w>=o->segments[done].len) {
+      w-=o->segments[done].len;
+      if (o->segments[done].shared) shared_message_release(o->segments[done].shared);
+      done++;
+    }
+    if (done<o->count) {
+      o->segments[done].offset+=w;
+      o->segments[done].len-=w;
+    }
+    o->count-=done;
+    memmove(o->segments,&o->segments[done],o->count*sizeof(struct output_segment));
+
+    // a short write means the socket is full
+    if (done<n) return 0;
+  }
+  output_release(o);
+  return 0;
+}
+
+// seconds on a clock that does not jump when the date is changed
+long long timer_clock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec;
+}
+
+void timer_wheel_init(struct timer_wheel *w) {
+  memset(w,0,sizeof(struct timer_wheel));
+  w->now=timer_clock();
+}
+
+void timer_place(struct timer_wheel *w,struct timer *timer) {
+  long long delta=timer->expires-w->now;
+  int level=0;
+  while(level<TIMER_LEVELS-1&&delta>=(1LL<<(TIMER_BITS*(level+1)))) level++;
+  int slot=(timer->expires>>(TIMER_BITS*level))&(TIMER_SLOTS-1);
+  struct timer **head=&w->slots[level][slot];
+  timer->prev=NULL;
+  timer->next=*head;
+  if (*head) (*head)->prev=timer;
+  *head=timer;
+}
+
+void timer_unlink(struct timer_wheel *w,struct timer *timer) {
+  if (timer->prev) timer->prev->next=timer->next;
+  else {
+    // find the slot it is at the head of
+    int level,slot;
+    for(level=0;level<TIMER_LEVELS;level++) {
+      slot=(timer->expires>>(TIMER_BITS*level))&(TIMER_SLOTS-1);
+      if (w->slots[level][slot]==timer) {
+        w->slots[level][slot]=timer->next;
+        break;
+      }
+    }
+  }
+  if (timer->next) timer->next->prev=timer->prev;
+  timer->prev=timer->next=NULL;
+}
+
+void timer_cancel(struct timer_wheel *w,struct timer *timer) {
+  if (!timer->armed) return;
+  timer_unlink(w,timer);
+  timer->armed=0;
+  w->count--;
+}
+
+// (re)arms a timer to fire at the given tick, or on the next one if that
+// has already passed
+void timer_schedule(struct timer_wheel *w,struct timer *timer,long long expires) {
+  timer_cancel(w,timer);
+  long long limit=w->now+(1LL<<(TIMER_BITS*TIMER_LEVELS))-1;
+  if (expires<=w->now) expires=w->now+1;
+  if (expires>limit) expires=limit;
+  timer->expires=expires;
+  timer->armed=1;
+  timer_place(w,timer);
+  w->count++;
+}
+
+// moves every timer in a slot of a coarse ring down to the finer rings
+void timer_cascade(struct timer_wheel *w,int level) {
+  int slot=(w->now>>(TIMER_BITS*level))&(TIMER_SLOTS-1);
+  struct timer *list=w->slots[level][slot];
+  w->slots[level][slot]=NULL;
+  while(list) {
+    struct timer *timer=list;
+    list=timer->next;
+    timer_place(w,timer);
+  }
+}
+
+// runs the clock forward to now, firing whatever falls due on the way.
+// a timer is unlinked before it fires, so it may re-arm or free itself.
+void timer_advance(struct timer_wheel *w,long long now) {
+  if (!w->count&&now>w->now) w->now=now;
+  while(w->now<now) {
+    w->now++;
+    int level;
+    for(level=1;level<TIMER_LEVELS;level++) {
+      if (w->now&((1LL<<(TIMER_BITS*level))-1)) break;
+      timer_cascade(w,level);
+    }
+    // cascading puts timers that are due now in this slot too
+    struct timer **head=&w->slots[0][w->now&(TIMER_SLOTS-1)];
+    while(*head) {
+      struct timer *timer=*head;
+      *head=timer->next;
+      if (*head) (*head)->prev=NULL;
+      timer->next=NULL;
+      timer->armed=0;
+      w->count--;
+      timer->fire(w,timer);
+    }
+  }
+}
+
+void output_free(struct output *o) {
+  int i;
+  for(i=0;i<o->count;i++)
+    if (o->segments[i].shared) shared_message_release(o->segments[i].shared);
+  output_release(o);
+  memset(o,0,sizeof(struct output));
+}
+
+int output_line_ends(struct output *o,struct output_segment *s) {
+  return (s->shared?s->shared->data:o->buf)[s->offset+s->len-1]=='\n';
+}
+
+// throws away whole lines from the front of the output until no more than
+// limit bytes are queued. the very first line may be part written, so it
+// stays. returns the number of lines dropped.
+int output_drop(struct output *o,long long limit) {
+  if (!o->count) return 0;
+  // our own lines are run together, so split the first one off the rest
+  struct output_segment *first=&o->segments[0];
+  if (!first->shared) {
+    char *nl=memchr(&o->buf[first->offset],'\n',first->len);
+    int len=nl?nl-&o->buf[first->offset]+1:first->len;
+    if (len<first->len) {
+      if (output_reserve(o,1)) return 0;
+      first=&o->segments[0];
+      memmove(&o->segments[2],&o->segments[1],(o->count-1)*sizeof(struct output_segment));
+      o->segments[1].shared=NULL;
+      o->segments[1].offset=first->offset+len;
+      o->segments[1].len=first->len-len;
+      first->len=len;
+      o->count++;
+    }
+  }
+
+  // a line cut down for one of several recipients is in pieces, and all
+  // of the first line stays
+  int keep=1;
+  while(keep<o->count&&!output_line_ends(o,&o->segments[keep-1])) keep++;
+  int end=keep,dropped=0,partial=0;
+  while(end<o->count&&(o->queued>limit||partial)) {
+    struct output_segment *s=&o->segments[end];
+    int cut=s->len;
+    if (!s->shared) {
+      char *nl=memchr(&o->buf[s->offset],'\n',s->len);
+      if (nl) cut=nl-&o->buf[s->offset]+1;
+    }
+    s->offset+=cut;
+    s->len-=cut;
+    o->queued-=cut;
+    partial=(s->shared?s->shared->data:o->buf)[s->offset-1]!='\n';
+    if (!partial) dropped++;
+    if (!s->len) {
+      if (s->shared) shared_message_release(s->shared);
+      end++;
+    }
+  }
+  memmove(&o->segments[keep],&o->segments[end],(o->count-end)*sizeof(struct output_segment));
+  o->count-=end-keep;
+  return dropped;
+}
+
+// called once a connection has written what it can. if more than
+// sendq_limit is still waiting, either drop the oldest lines or give up on
+// the connection: tell it why if there is room, and shut down our side so
+// that its reader closes it the same way as a hangup.
+// returns -1 if the connection is being closed.
+int output_sendq_check(struct client_thread *t) {
+  struct output *o=&t->output;
+  if (t->sendq_exceeded) return -1;
+  if (o->queued<=sendq_limit) return 0;
+  if (sendq_drop) {
+    stat_add(&stats()->sendq_drops,output_drop(o,sendq_limit));
+    return 0;
+  }
+  stat_add(&stats()->sendq_kills,1);
+  t->sendq_exceeded=1;
+  output_free(o);
+  output_printf(t,"ERROR :SendQ exceeded\n");
+  output_flush(t);
+  shutdown(t->fd,SHUT_RD);
+  return -1;
+}
+
+// in thread mode every connection's idle timer is on one wheel, driven by a
+// thread of its own. in reactor mode each worker has a wheel for its own
+// connections and needs no lock for it.
+struct timer_wheel client_timers;
+pthread_mutex_t client_timers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void reactor_close(struct client_thread *t,char *reason);
+
+void link_send(struct client_thread *t,const char *fmt,...);
+
+void client_idle_expired(struct timer_wheel *w,struct timer *timer) {
+  struct client_thread *t=timer->data;
+  // data has arrived since the timer was set, so wait out the rest
+  long long due=__atomic_load_n(&t->time_of_last_data,__ATOMIC_RELAXED)+t->timeout;
+  if (due>w->now) {
+    t->ping_sent=0;
+    timer_schedule(w,timer,due);
+    return;
+  }
+  // quiet because flood control is holding its input back, not idle
+  if (__atomic_load_n(&t->holding,__ATOMIC_RELAXED)) {
+    timer_schedule(w,timer,w->now+t->timeout);
+    return;
+  }
+  // a quiet link or client is asked whether it is still there before we
+  // give up on it
+  if ((t->server||t->user_has_registered)&&!t->ping_sent) {
+    t->ping_sent=1;
+    link_send(t,"PING :%s\n",server_name);
+    timer_schedule(w,timer,w->now+t->timeout);
+    return;
+  }
+  if (w!=&client_timers) {
+    reactor_close(t,"Connection timed out length=0");
+    return;
+  }
+  // wake the connection's thread, which sends the ERROR and closes up.
+  // it cancels this timer before closing the socket, so the socket is
+  // still its own here.
+  t->timed_out=1;
+  shutdown(t->fd,SHUT_RD);
+}
+
+void client_timer_start(struct client_thread *t,struct timer_wheel *w) {
+  t->timers=w;
+  t->idle_timer.fire=client_idle_expired;
+  t->idle_timer.data=t;
+  t->time_of_last_data=timer_clock();
+  if (w==&client_timers) pthread_mutex_lock(&client_timers_lock);
+  timer_schedule(w,&t->idle_timer,t->time_of_last_data+t->timeout);
+  if (w==&client_timers) pthread_mutex_unlock(&client_timers_lock);
+}
+
+void client_timer_stop(struct client_thread *t) {
+  struct timer_wheel *w=t->timers;
+  if (!w) return;
+  if (w==&client_timers) pthread_mutex_lock(&client_timers_lock);
+  timer_cancel(w,&t->idle_timer);
+  if (w==&client_timers) pthread_mutex_unlock(&client_timers_lock);
+}
+
+// moves the timer to go off by t->timeout, which may have got shorter
+void client_timer_reset(struct client_thread *t) {
+  struct timer_wheel *w=t->timers;
+  if (!w) return;
+  if (w==&client_timers) pthread_mutex_lock(&client_timers_lock);
+  timer_schedule(w,&t->idle_timer,t->time_of_last_data+t->timeout);
+  if (w==&client_timers) pthread_mutex_unlock(&client_timers_lock);
+}
+
+void *client_timer_thread(void *data) {
+  while(1) {
+    sleep(1);
+    pthread_mutex_lock(&client_timers_lock);
+    timer_advance(&client_timers,timer_clock());
+    pthread_mutex_unlock(&client_timers_lock);
+  }
+  return NULL;
+}
+
+void channel_part_all(struct client_thread *t);
+
+void link_lost(struct client_thread *t);
+void link_peer_down(int peer);
+void link_broadcast(struct client_thread *skip,const char *fmt,...);
+void journal_unwait(struct client_thread *t);
+
+// once we have left our channels and released the nickname nobody can
+// deliver to us any more, so the inbox can go. the other servers are told
+// that we have gone, or if we were a link, forget what was behind it.
+void client_unregister(struct client_thread *t) {
+  client_timer_stop(t);
+  channel_part_all(t);
+  if (t->user_has_registered) link_broadcast(NULL,":%s QUIT :Client exited\n",t->nickname);
+  nick_release(t);
+  if (t->server) link_lost(t);
+  if (t->link_peer) link_peer_down(t->link_peer-1);
+  journal_unwait(t);
+  inbox_free(&t->inbox);
+  output_free(&t->output);
+  client_line_release(t);
+  pool_free(t->held,t->held_size);
+  t->held=NULL;
+  t->holding=0;
+}
+
+// a record for a line made by shared_message_privmsg, taking a reference
+// to it. the line has to fit in a journal entry.
+struct log_record *log_record_new(struct shared_message *sm,int targets,int targets_len,
+                                  int recipient,int recipient_len) {
+  if (sm->len>65535) return NULL;
+  struct log_record *r=pool_alloc(sizeof(struct log_record));
+  if (!r) return NULL;
+  r->delivered=NULL;
+  r->shared=sm;
+  r->recipient=recipient;
+  r->recipient_len=recipient_len;
+  r->targets=targets;
+  r->targets_len=targets_len;
+  __atomic_add_fetch(&sm->refs,1,__ATOMIC_RELAXED);
+  return r;
+}
+
+void log_record_free(struct log_record *r) {
+  shared_message_release(r->shared);
+  pool_free(r,sizeof(struct log_record));
+}
+
+void message_log_free(long long n) {
+  int slot=n%message_log_size;
+  struct log_record *r=message_log[slot];
+  if (r) log_record_free(r);
+  message_log[slot]=NULL;
+}
+
+int message_log_init(int size) {
+  message_log_size=size;
+  message_log=calloc(size,sizeof(struct log_record *));
+  if (!message_log) return -1;
+  return 0;
+}
+
+// optional journal of private messages, so that a restarted server can
+// pick up where it left off. records are copied into a run of memory
+// mapped segment files as messages are appended, and a commit thread
+// msyncs them in groups: each append joins the open commit, and the
+// thread closes it, syncs everything in it at once and then opens the
+// next, while appends carry on into that. senders never wait for the
+// disk, but recipients do: mail for a record is only moved to their
+// output once its commit is on disk, so a message that has been
+// delivered is never lost. with nothing to commit the thread still looks
+// every JOURNAL_IDLE_MS for segments to remove. on startup the segments
+// are scanned to rebuild the log.
+// when a message is delivered its record is marked as such in place; the
+// marks are left to the kernel to write back, so after a power failure a
+// few messages may be delivered twice. a line to several nicknames is
+// written once for every JOURNAL_RUN of them, as that is how many bits
+// the mark has.
+#define JOURNAL_SEGMENT (64*1024*1024)
+#define JOURNAL_IDLE_MS 10
+#define JOURNAL_RUN 32
+
+struct journal_entry {
+  // of the whole entry, a multiple of 8. zero marks the end of a segment.
+  unsigned int size;
+  // a bit for each nickname, set once they have had the line
+  unsigned int delivered;
+  // over everything from message to the end of the entry
+  unsigned long long check;
+  long long message;
+  // where the nicknames it is for are in the line
+  unsigned short recipient;
+  unsigned short recipient_len;
+  // of the line as it was sent, which is all of data
+  unsigned int length;
+  char data[];
+};
+
+struct journal_segment {
+  int index;
+  char *map;
+  // bytes written, and bytes known to be on disk
+  long used;
+  long synced;
+  // last message in the segment
+  long long last;
+  struct journal_segment *next;
+};
+
+char *journal_dir=NULL;
+// protects the list of segments. appending only needs it to start a new
+// segment; the current one belongs to whoever holds message_log_lock.
+pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+struct journal_segment *journal_segments=NULL;
+struct journal_segment *journal_current=NULL;
+// messages before this came from the journal, and may not have been
+// delivered before the restart
+long long journal_recovered=0;
+// how many messages the journal put back in the log
+long long journal_restored=0;
+int journal_stop=0;
+pthread_t journal_thread;
+
+// appends join commit journal_epoch, which only changes under
+// message_log_lock. journal_durable is the last commit on disk, and
+// journal_dirty says something has been appended since a commit closed.
+// the commit thread sleeps on journal_wake until there is.
+long long journal_epoch=1;
+long long journal_durable=0;
+int journal_dirty=0;
+pthread_mutex_t journal_commit_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t journal_wake_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t journal_wake = PTHREAD_COND_INITIALIZER;
+// connections holding mail for a commit not on disk yet, to be woken
+// once it is
+pthread_mutex_t journal_waiters_lock = PTHREAD_MUTEX_INITIALIZER;
+struct client_thread *journal_waiters=NULL;
+
+unsigned long long journal_check(struct journal_entry *e) {
+  unsigned long long h=0xcbf29ce484222325ULL;
+  unsigned long long *w=(unsigned long long *)&e->message;
+  unsigned long long *end=(unsigned long long *)((char *)e+e->size);
+  for(;w<end;w++) {
+    h^=*w;
+    h*=0x9e3779b97f4a7c15ULL;
+    h^=h>>29;
+  }
+  return h;
+}
+
+// maps segment index, creating it if need be
+struct journal_segment *journal_segment_open(int index,int create) {
+  char path[1024];
+  snprintf(path,1024,"%s/journal.%08d",journal_dir,index);
+  int fd=open(path,O_RDWR|(create?O_CREAT:0),0600);
+  if (fd==-1) return NULL;
+  // allocate the blocks now, so running out of disk is an error here
+  // rather than a SIGBUS later
+  if (create&&posix_fallocate(fd,0,JOURNAL_SEGMENT)) { close(fd); return NULL; }
+  struct stat st;
+  if (fstat(fd,&st)||st.st_size<JOURNAL_SEGMENT) { close(fd); return NULL; }
+  char *map=mmap(NULL,JOURNAL_SEGMENT,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+  close(fd);
+  if (map==MAP_FAILED) return NULL;
+  struct journal_segment *s=calloc(sizeof(struct journal_segment),1);
+  if (!s) { munmap(map,JOURNAL_SEGMENT); return NULL; }
+  s->index=index;
+  s->map=map;
+  s->last=-1;
+  return s;
+}
+
+void journal_segment_remove(struct journal_segment *s) {
+  char path[1024];
+  snprintf(path,1024,"%s/journal.%08d",journal_dir,s->index);
+  munmap(s->map,JOURNAL_SEGMENT);
+  unlink(path);
+  free(s);
+}
+
+// writes a record for message to the journal, with the delivered bits in
+// done already set. caller must hold message_log_lock as a writer.
+int journal_append(struct log_record *r,long long message,unsigned int done) {
+  int length=r->shared->len;
+  int size=(sizeof(struct journal_entry)+length+7)&~7;
+  struct journal_segment *s=journal_current;
+  if (!s||s->used+size>JOURNAL_SEGMENT) {
+    s=journal_segment_open(s?s->index+1:0,1);
+    if (!s) return -1;
+    pthread_mutex_lock(&journal_lock);
+    if (journal_current) journal_current->next=s; else journal_segments=s;
+    journal_current=s;
+    pthread_mutex_unlock(&journal_lock);
+  }
+  struct journal_entry *e=(struct journal_entry *)&s->map[s->used];
+  e->size=size;
+  e->delivered=done;
+  e->message=message;
+  e->recipient=r->recipient;
+  e->recipient_len=r->recipient_len;
+  e->length=length;
+  memcpy(e->data,r->shared->data,length);
+  memset(&e->data[length],0,size-sizeof(struct journal_entry)-length);
+  e->check=journal_check(e);
+  r->delivered=&e->delivered;
+  s->last=message;
+  __atomic_store_n(&s->used,s->used+size,__ATOMIC_RELEASE);
+  return 0;
+}
+
+void client_notify(struct client_thread *t);
+
+// tells the commit thread there is something to commit
+void journal_kick(void) {
+  if (__atomic_exchange_n(&journal_dirty,1,__ATOMIC_ACQ_REL)) return;
+  pthread_mutex_lock(&journal_wake_lock);
+  pthread_cond_signal(&journal_wake);
+  pthread_mutex_unlock(&journal_wake_lock);
+}
+
+// closes the open commit, syncs everything appended so far and removes
+// segments whose messages have all left the log. then wakes whoever is
+// holding mail for the commit.
+void journal_commit(void) {
+  long page=sysconf(_SC_PAGESIZE);
+  pthread_mutex_lock(&journal_commit_lock);
+  // appends are made under message_log_lock, so once we have had it every
+  // record in the commit we close is in its segment
+  pthread_rwlock_wrlock(&message_log_lock);
+  long long epoch=journal_epoch++;
+  __atomic_store_n(&journal_dirty,0,__ATOMIC_RELAXED);
+  pthread_rwlock_unlock(&message_log_lock);
+  pthread_mutex_lock(&journal_lock);
+  struct journal_segment *s;
+  for(s=journal_segments;s;s=s->next) {
+    long used=__atomic_load_n(&s->used,__ATOMIC_ACQUIRE);
+    if (used==s->synced) continue;
+    long start=s->synced&~(page-1);
+    msync(&s->map[start],used-start,MS_SYNC);
+    s->synced=used;
+  }
+  // readers only mark messages from message_log_tail on, and it only
+  // ever goes up
+  long long tail=__atomic_load_n(&message_log_tail,__ATOMIC_ACQUIRE);
+  while(journal_segments!=journal_current&&journal_segments->last<tail) {
+    s=journal_segments;
+    journal_segments=s->next;
+    journal_segment_remove(s);
+  }
+  pthread_mutex_unlock(&journal_lock);
+
+  // a waiter checks journal_durable again after joining the list, so it
+  // either sees this or is on the list by the time we take it
+  __atomic_store_n(&journal_durable,epoch,__ATOMIC_SEQ_CST);
+  pthread_mutex_lock(&journal_waiters_lock);
+  struct client_thread *t=journal_waiters;
+  journal_waiters=NULL;
+  while(t) {
+    struct client_thread *next=t->journal_next;
+    t->journal_waiting=0;
+    client_notify(t);
+    t=next;
+  }
+  pthread_mutex_unlock(&journal_waiters_lock);
+  pthread_mutex_unlock(&journal_commit_lock);
+}
+
+void *journal_commit_thread(void *data) {
+  while(!__atomic_load_n(&journal_stop,__ATOMIC_RELAXED)) {
+    pthread_mutex_lock(&journal_wake_lock);
+    if (!__atomic_load_n(&journal_dirty,__ATOMIC_ACQUIRE)&&!journal_stop) {
+      struct timespec ts;
+      clock_gettime(CLOCK_REALTIME,&ts);
+      ts.tv_nsec+=JOURNAL_IDLE_MS*1000000L;
+      if (ts.tv_nsec>=1000000000L) { ts.tv_sec++; ts.tv_nsec-=1000000000L; }
+      pthread_cond_timedwait(&journal_wake,&journal_wake_lock,&ts);
+    }
+    pthread_mutex_unlock(&journal_wake_lock);
+    journal_commit();
+  }
+  journal_commit();
+  return NULL;
+}
+
+// keeps mail whose commit is not on disk yet until it is, with t on the
+// list to be woken then. returns 0 if it is on disk after all.
+int journal_hold(struct client_thread *t,struct mail *m) {
+  pthread_mutex_lock(&journal_waiters_lock);
+  if (!t->journal_waiting) {
+    t->journal_next=journal_waiters;
+    journal_waiters=t;
+    t->journal_waiting=1;
+  }
+  pthread_mutex_unlock(&journal_waiters_lock);
+  if (m->epoch<=__atomic_load_n(&journal_durable,__ATOMIC_SEQ_CST)) return 0;
+  t->journal_wait=m;
+  return 1;
+}
+
+// takes a connection that is going away off the list of waiters
+void journal_unwait(struct client_thread *t) {
+  if (t->journal_wait) inbox_free_mail(t->journal_wait);
+  t->journal_wait=NULL;
+  pthread_mutex_lock(&journal_waiters_lock);
+  if (t->journal_waiting) {
+    struct client_thread **p=&journal_waiters;
+    while(*p!=t) p=&(*p)->journal_next;
+    *p=t->journal_next;
+    t->journal_waiting=0;
+  }
+  pthread_mutex_unlock(&journal_waiters_lock);
+}
+
+// the log record for an entry found on recovery
+struct log_record *journal_record(struct journal_entry *e) {
+  struct shared_message *sm=pool_alloc(sizeof(struct shared_message)+e->length+1);
+  if (!sm) return NULL;
+  sm->refs=1;
+  sm->len=e->length;
+  memcpy(sm->data,e->data,e->length);
+  sm->data[e->length]=0;
+  // the target list follows the sender, who has no spaces in their name
+  char *space=memchr(sm->data,' ',e->length);
+  int targets=space?space-sm->data+9:e->recipient;
+  char *end=memchr(&sm->data[targets],' ',e->length-targets);
+  int targets_len=end?end-&sm->data[targets]:0;
+  if (targets>e->recipient||targets+targets_len<e->recipient+e->recipient_len) {
+    targets=e->recipient;
+    targets_len=e->recipient_len;
+  }
+  struct log_record *r=log_record_new(sm,targets,targets_len,e->recipient,e->recipient_len);
+  shared_message_release(sm);
+  if (r) r->delivered=&e->delivered;
+  return r;
+}
+
+int journal_compare(const void *a,const void *b) {
+  return *(int *)a-*(int *)b;
+}
+
+// reads the segments that are in journal_dir, in order, putting the newest
+// message_log_size messages back in the log. a torn or out of sequence
+// record ends the journal; anything after it is thrown away.
+int journal_recover(void) {
+  DIR *d=opendir(journal_dir);
+  if (!d) return -1;
+  int *indices=NULL,count=0,size=0,index;
+  struct dirent *de;
+  while((de=readdir(d))) {
+    if (sscanf(de->d_name,"journal.%d",&index)!=1) continue;
+    if (count>=size) {
+      size=size?size*2:64;
+      int *n=realloc(indices,size*sizeof(int));
+      if (!n) { closedir(d); free(indices); return -1; }
+      indices=n;
+    }
+    indices[count++]=index;
+  }
+  closedir(d);
+  qsort(indices,count,sizeof(int),journal_compare);
+
+  // which entry holds the newest message for each slot of the log
+  struct journal_entry **entries=calloc(message_log_size,sizeof(struct journal_entry *));
+  if (!entries) { free(indices); return -1; }
+  long long next=-1,first=-1;
+  int i,broken=0;
+  for(i=0;i<count;i++) {
+    struct journal_segment *s=broken?NULL:journal_segment_open(indices[i],0);
+    if (!s) {
+      // nothing after a gap can be trusted
+      char path[1024];
+      snprintf(path,1024,"%s/journal.%08d",journal_dir,indices[i]);
+      unlink(path);
+      broken=1;
+      continue;
+    }
+    while(s->used+sizeof(struct journal_entry)<=JOURNAL_SEGMENT) {
+      struct journal_entry *e=(struct journal_entry *)&s->map[s->used];
+      if (e->size<sizeof(struct journal_entry)||e->size&7||e->size>JOURNAL_SEGMENT-s->used||
+          e->length>e->size-sizeof(struct journal_entry)||
+          e->recipient<10||e->recipient+e->recipient_len>e->length||
+          (next!=-1&&e->message!=next)||e->check!=journal_check(e)) break;
+      if (first==-1) first=e->message;
+      next=e->message+1;
+      entries[e->message%message_log_size]=e;
+      s->last=e->message;
+      s->used+=e->size;
+    }
+    s->synced=s->used;
+    if (s->used+sizeof(struct journal_entry)<=JOURNAL_SEGMENT&&
+        ((struct journal_entry *)&s->map[s->used])->size) {
+      // torn: clear it out so it cannot be mistaken for a record later
+      memset(&s->map[s->used],0,JOURNAL_SEGMENT-s->used);
+      broken=1;
+    }
+    if (journal_current) journal_current->next=s; else journal_segments=s;
+    journal_current=s;
+  }
+  free(indices);
+
+  if (next!=-1) {
+    message_count=next;
+    message_log_tail=next-message_log_size>first?next-message_log_size:first;
+  }
+  journal_recovered=message_count;
+  journal_restored=message_count-message_log_tail;
+  long long n;
+  for(n=message_log_tail;n<message_count;n++) {
+    struct journal_entry *e=entries[n%message_log_size];
+    struct log_record *r=journal_record(e);
+    if (!r) { free(entries); return -1; }
+    message_log[n%message_log_size]=r;
+  }
+  free(entries);
+  return 0;
+}
+
+int journal_open(char *dir) {
+  journal_dir=dir;
+  journal_stop=0;
+  if (journal_recover()) return -1;
+  return pthread_create(&journal_thread,NULL,journal_commit_thread,NULL)?-1:0;
+}
+
+// commits everything and unmaps the journal
+void journal_close(void) {
+  pthread_mutex_lock(&journal_wake_lock);
+  __atomic_store_n(&journal_stop,1,__ATOMIC_RELAXED);
+  pthread_cond_signal(&journal_wake);
+  pthread_mutex_unlock(&journal_wake_lock);
+  pthread_join(journal_thread,NULL);
+  while(journal_segments) {
+    struct journal_segment *s=journal_segments;
+    journal_segments=s->next;
+    munmap(s->map,JOURNAL_SEGMENT);
+    free(s);
+  }
+  journal_current=NULL;
+  journal_dir=NULL;
+}
+
+// queues messages for a newly registered nickname that were in the
+// journal when we started and had not been delivered
+void journal_redeliver(struct client_thread *t) {
+  if (__atomic_load_n(&message_log_tail,__ATOMIC_ACQUIRE)>=journal_recovered) return;
+  int found=0;
+  long long now=clock_ns();
+  message_log_lock_wait(0);
+  long long n;
+  for(n=message_log_tail;n<journal_recovered;n++) {
+    struct log_record *r=message_log[n%message_log_size];
+    unsigned int done=__atomic_load_n(r->delivered,__ATOMIC_RELAXED);
+    // the nicknames the record is for, one delivered bit each
+    char *data=r->shared->data;
+    int at=r->recipient,end=r->recipient+r->recipient_len,bit;
+    for(bit=0;at<end&&bit<JOURNAL_RUN;bit++) {
+      char *comma=memchr(&data[at],',',end-at);
+      int len=comma?comma-&data[at]:end-at;
+      char nick[32],folded[32];
+      int l=len<31?len:31;
+      memcpy(nick,&data[at],l);
+      nick[l]=0;
+      nick_fold(folded,nick);
+      if (!(done&1u<<bit)&&!strcmp(folded,t->folded_nick)) {
+        struct mail *m=mail_new(r->shared,now);
+        if (!m) break;
+        mail_cut(m,r->targets,r->targets_len,at,len);
+        m->delivered=r->delivered;
+        m->delivered_bit=1u<<bit;
+        m->message=n;
+        inbox_push(&t->inbox,m);
+        found=1;
+        break;
+      }
+      at+=len+1;
+    }
+  }
+  pthread_rwlock_unlock(&message_log_lock);
+  if (found) client_notify(t);
+}
+
+// adds a record to the end of the log, forgetting the oldest if the log
+// is full, and journals it with the delivered bits in done set. returns
+// its message number. caller must hold message_log_lock as a writer.
+long long message_log_add(struct log_record *r,unsigned int done) {
+  if (message_count-message_log_tail>=message_log_size) {
+    message_log_free(message_log_tail);
+    __atomic_store_n(&message_log_tail,message_log_tail+1,__ATOMIC_RELEASE);
+  }
+  message_log[message_count%message_log_size]=r;
+  if (journal_append(r,message_count,done)) perror("Could not write to the journal");
+  __atomic_store_n(&message_count,message_count+1,__ATOMIC_RELEASE);
+  return message_count-1;
+}
+
+// how many nicknames one PRIVMSG may name
+#define MAX_TARGETS 64
+
+// one nickname from a PRIVMSG target list
+struct privmsg_target {
+  char *nick;
+  char folded[32];
+  unsigned int h;
+  // where it is in the line
+  int offset;
+  int len;
+  struct mail *mail;
+  // who it goes to, if they are here
+  struct client_thread *recipient;
+};
+
+// puts mail in r's inbox and wakes r
+void privmsg_push(struct client_thread *r,struct mail *m) {
+  if (trace_read) {
+    m->traced=trace_read;
+    m->queued=clock_ns();
+  }
+  inbox_push(&r->inbox,m);
+  stat_add(&stats()->appended,1);
+  client_notify(r);
+}
+
+// puts a private message in the inbox of every nickname in nicks, or of
+// the link to the server they are on. the line is made once, with the
+// whole target list in it, and every recipient shares it. the locks for
+// all the nicknames are taken together, each only once, and only with a
+// journal does it go through the message log, and so take
+// message_log_lock. from is the link the message came in on, if any:
+// anyone reached through it is left to the server that sent it.
+// puts the nicknames that nobody is using in missing, and returns how many.
+int privmsg_send(char *sender,char **nicks,int count,char *message,
+                 struct client_thread *from,char **missing) {
+  struct privmsg_target targets[MAX_TARGETS];
+  // with a journal, a record for each JOURNAL_RUN of the nicknames, and
+  // which of them are here
+  struct log_record *records[(MAX_TARGETS+JOURNAL_RUN-1)/JOURNAL_RUN];
+  unsigned int here[(MAX_TARGETS+JOURNAL_RUN-1)/JOURNAL_RUN];
+  char list[LINE_SIZE];
+  int i,j,n=0,len=0,missed=0,journaled=0;
+  if (count>MAX_TARGETS) count=MAX_TARGETS;
+  // get everything ready before taking any lock
+  for(i=0;i<count;i++) {
+    struct privmsg_target *p=&targets[n];
+    nick_fold(p->folded,nicks[i]);
+    for(j=0;j<n&&strcmp(targets[j].folded,p->folded);j++);
+    if (j<n) continue;
+    int l=strlen(nicks[i]);
+    if (len+l+1>LINE_SIZE) { missing[missed++]=nicks[i]; continue; }
+    if (n) list[len++]=',';
+    memcpy(&list[len],nicks[i],l);
+    p->nick=nicks[i];
+    p->h=nick_hash(p->folded);
+    p->offset=len;
+    p->len=l;
+    len+=l;
+    n++;
+  }
+  if (!n) return missed;
+  int sender_len=strlen(sender);
+  struct shared_message *sm=shared_message_privmsg(sender,sender_len,list,len,message,strlen(message));
+  int at=1+sender_len+9;
+  long long now=clock_ns();
+  for(i=0;i<n;i++) {
+    struct privmsg_target *p=&targets[i];
+    p->offset+=at;
+    p->mail=sm?mail_new(sm,now):NULL;
+    p->recipient=NULL;
+  }
+  int runs=journal_dir?(n+JOURNAL_RUN-1)/JOURNAL_RUN:0;
+  for(i=0;i<runs;i++) {
+    struct privmsg_target *first=&targets[i*JOURNAL_RUN];
+    struct privmsg_target *last=&targets[(i+1)*JOURNAL_RUN<n?(i+1)*JOURNAL_RUN-1:n-1];
+    records[i]=sm?log_record_new(sm,at,len,first->offset,last->offset+last->len-first->offset):NULL;
+    here[i]=0;
+  }
+  if (sm) shared_message_release(sm);
+
+  // every stripe lock we need, in address order like nick_claim
+  pthread_mutex_t *locks[MAX_TARGETS];
+  int lock_count=0;
+  for(i=0;i<n;i++) {
+    pthread_mutex_t *l=nick_lock(targets[i].h);
+    for(j=0;j<lock_count&&locks[j]!=l;j++);
+    if (j<lock_count) continue;
+    for(j=lock_count;j>0&&locks[j-1]>l;j--) locks[j]=locks[j-1];
+    locks[j]=l;
+    lock_count++;
+  }
+  if (journal_dir) message_log_lock_wait(1);
+  for(i=0;i<lock_count;i++) pthread_mutex_lock(locks[i]);
+  long long locked=trace_read?clock_ns():0;
+
+  // recipients cannot disconnect while we hold their nicknames' locks
+  struct client_thread *links[MAX_TARGETS];
+  int link_count=0;
+  for(i=0;i<n;i++) {
+    struct privmsg_target *p=&targets[i];
+    struct mail *m=p->mail;
+    if (!m||(runs&&!records[i/JOURNAL_RUN])) { missing[missed++]=p->nick; continue; }
+    struct client_thread *r=nick_find_locked(p->folded,p->h);
+    if (r) {
+      mail_cut(m,at,len,p->offset,p->len);
+      p->recipient=r;
+      if (runs) here[i/JOURNAL_RUN]|=1u<<i%JOURNAL_RUN;
+      continue;
+    }
+    // someone on another server: the whole line goes down the link
+    // towards them, once, and the servers there sort out the rest
+    struct remote_user *u=remote_find_locked(p->folded,p->h);
+    if (!u) { missing[missed++]=p->nick; continue; }
+    r=u->server->link;
+    for(j=0;j<link_count&&links[j]!=r;j++);
+    if (r==from||j<link_count) continue;
+    links[link_count++]=r;
+    p->mail=NULL;
+    privmsg_push(r,m);
+  }
+  // the line goes in the log once for each run with someone here in it,
+  // already marked delivered to everyone else in the run
+  for(i=0;i<runs;i++) {
+    if (!here[i]) continue;
+    long long number=message_log_add(records[i],~here[i]);
+    journaled=1;
+    for(j=i*JOURNAL_RUN;j<n&&j<(i+1)*JOURNAL_RUN;j++) {
+      struct mail *m=targets[j].mail;
+      if (!targets[j].recipient) continue;
+      m->epoch=journal_epoch;
+      m->message=number;
+      m->delivered=records[i]->delivered;
+      m->delivered_bit=1u<<j%JOURNAL_RUN;
+    }
+    records[i]=NULL;
+  }
+  for(i=0;i<n;i++) {
+    if (!targets[i].recipient) continue;
+    privmsg_push(targets[i].recipient,targets[i].mail);
+    targets[i].mail=NULL;
+  }
+  if (trace_read) trace_record(TRACE_SEND,trace_read,trace_parsed,locked,clock_ns());
+
+  for(i=lock_count-1;i>=0;i--) pthread_mutex_unlock(locks[i]);
+  if (journal_dir) pthread_rwlock_unlock(&message_log_lock);
+  if (journaled) journal_kick();
+  // whatever was not needed after all
+  for(i=0;i<n;i++)
+    if (targets[i].mail) inbox_free_mail(targets[i].mail);
+  for(i=0;i<runs;i++)
+    if (records[i]) log_record_free(records[i]);
+  return missed;
+}
+
+// a private message to a single nickname. returns -1 if nobody is using it.
+int message_log_append(char *sender,char *recipient,char *message) {
+  char *missing;
+  return privmsg_send(sender,&recipient,1,message,NULL,&missing)?-1:0;
+}
+
+// the next mail for us: one held for the journal comes before the inbox
+struct mail *mail_next(struct client_thread *t) {
+  struct mail *m=t->journal_wait;
+  if (!m) return inbox_pop(&t->inbox);
+  t->journal_wait=NULL;
+  return m;
+}
+
+// moves whatever is in our inbox to our output, up to the first mail whose
+// journal commit is not on disk yet
+void inbox_collect(struct client_thread *t) {
+  struct mail *m;
+  if ((m=mail_next(t))) {
+    struct stats *s=stats();
+    long long now=clock_ns();
+    int locked=0;
+    for(;m;m=mail_next(t)) {
+      if (m->epoch>__atomic_load_n(&journal_durable,__ATOMIC_SEQ_CST)&&journal_hold(t,m)) break;
+      // the journal keeps a segment until the log's tail has passed every
+      // message in it, and the tail cannot move while we hold the lock
+      if (m->delivered) {
+        if (!locked) message_log_lock_wait(0);
+        locked=1;
+        if (m->message>=message_log_tail)
+          __atomic_or_fetch(m->delivered,m->delivered_bit,__ATOMIC_RELAXED);
+      }
+      if (m->traced&&!trace_delivery.at[0]) {
+        trace_delivery.at[0]=m->traced;
+        trace_delivery.at[1]=m->queued;
+        trace_delivery.at[2]=now;
+      }
+      output_mail(t,m);
+      stat_add(&s->delivered,1);
+      stat_latency(s,now-m->queued);
+      pool_free(m,sizeof(struct mail));
+    }
+    if (locked) pthread_rwlock_unlock(&message_log_lock);
+  }
+}
+
+// our nickname has been killed by another server: tell the client why,
+// and shut down our side so that its reader closes it the same way as a
+// hangup. returns -1.
+int client_killed(struct client_thread *t) {
+  t->killed=2;
+  output_printf(t,"ERROR :Closing Link: Killed (Nick collision)\n");
+  output_flush(t);
+  shutdown(t->fd,SHUT_RD);
+  return -1;
+}
+
+// moves everything in our inbox to the output and sends what we can of it
+int inbox_read(struct client_thread *t) {
+  if (!t->sendq_exceeded) inbox_collect(t);
+  if (__atomic_load_n(&t->killed,__ATOMIC_ACQUIRE)==1) return client_killed(t);
+  if (!t->output.count) return 0;
+  if (t->uring&&trace_delivery.at[0]) {
+    uring_trace(t,&trace_delivery);
+    trace_delivery.at[0]=0;
+  }
+  int r=output_flush(t);
+  if (trace_delivery.at[0]) {
+    struct trace_event *e=&trace_delivery;
+    trace_record(TRACE_DELIVERY,e->at[0],e->at[1],e->at[2],clock_ns());
+    e->at[0]=0;
+  }
+  if (r) return -1;
+  return output_sendq_check(t);
+}
+
+// channels, hashed by their case-folded names. each channel keeps an array
+// of its members so that a message can be queued to all of them in one
+// pass; each client keeps a list of the channels it is on. channels_lock
+// protects all of it.
+#define CHANNEL_BUCKETS 4096
+#define MAX_CHANNEL_NAME 50
+
+struct channel {
+  char name[MAX_CHANNEL_NAME+1];
+  char folded[MAX_CHANNEL_NAME+1];
+  struct membership **members;
+  int member_count;
+  int size;
+  struct channel *next;
+};
+
+struct membership {
+  struct channel *channel;
+  struct client_thread *client;
+  // our slot in channel->members
+  int index;
+  // the member's nickname, kept here for NAMES, as other threads may only
+  // look at client->nickname under its nick stripe lock
+  char nick[32];
+  struct membership *next;
+};
+
+pthread_rwlock_t channels_lock = PTHREAD_RWLOCK_INITIALIZER;
+struct channel *channel_table[CHANNEL_BUCKETS];
+int channel_count=0;
+
+int channel_name_valid(const char *name) {
+  if (name[0]!='#'&&name[0]!='&') return 0;
+  int i;
+  for(i=1;name[i];i++) {
+    if (i>=MAX_CHANNEL_NAME) return 0;
+    if (name[i]==' '||name[i]==','||name[i]==7) return 0;
+  }
+  return i>1;
+}
+
+void channel_fold(char *folded,const char *name) {
+  int i;
+  for(i=0;i<MAX_CHANNEL_NAME&&name[i];i++) {
+    char c=name[i];
+    if (c>='A'&&c<='^') c+='a'-'A';
+    folded[i]=c;
+  }
+  folded[i]=0;
+}
+
+// caller must hold channels_lock
+struct channel *channel_find(const char *name) {
+  char folded[MAX_CHANNEL_NAME+1];
+  channel_fold(folded,name);
+  struct channel *c;
+  for(c=channel_table[nick_hash(folded)&(CHANNEL_BUCKETS-1)];c;c=c->next)
+    if (!strcmp(c->folded,folded)) return c;
+  return NULL;
+}
+
+// caller must hold channels_lock
+struct membership *channel_membership(struct client_thread *t,struct channel *c) {
+  struct membership *m;
+  for(m=t->channels;m;m=m->next)
+    if (m->channel==c) return m;
+  return NULL;
+}
+
+// queues one shared copy of line to every member of the channel other than
+// skip. caller must hold channels_lock.
+int channel_send(struct channel *c,struct client_thread *skip,const char *line) {
+  struct shared_message *sm=shared_message_new(line);
+  if (!sm) return -1;
+  long long now=clock_ns();
+  int i;
+  for(i=0;i<c->member_count;i++) {
+    struct client_thread *t=c->members[i]->client;
+    if (t==skip) continue;
+    struct mail *m=mail_new(sm,now);
+    if (!m) continue;
+    inbox_push(&t->inbox,m);
+    client_notify(t);
+  }
+  stat_add(&stats()->appended,1);
+  shared_message_release(sm);
+  return 0;
+}
+
+// sends the 353 and 366 replies listing who is on a channel.
+// caller must hold channels_lock.
+void channel_names(struct client_thread *t,struct channel *c) {
+  char msg[1024];
+  int len=0;
+  int i;
+  for(i=0;i<c->member_count;i++) {
+    char *nick=c->members[i]->nick;
+    if (len&&len+strlen(nick)+2>=512) {
+      msg[len++]='\n';
+      output_append(t,msg,len);
+      len=0;
+    }
+    if (!len) len=snprintf(msg,1024,":%s 353 %s = %s :",server_name,t->nickname,c->name);
+    else msg[len++]=' ';
+    len+=snprintf(&msg[len],1024-len,"%s",nick);
+  }
+  if (len) {
+    msg[len++]='\n';
+    output_append(t,msg,len);
+  }
+  output_printf(t,":%s 366 %s %s :End of NAMES list\n",server_name,t->nickname,c->name);
+}
+
+// a connection handed over on restart joins quietly, since the other
+// members know it is there already
+int channel_join(struct client_thread *t,char *name,int quiet) {
+  char msg[1024];
+  if (!channel_name_valid(name)) {
+    output_printf(t,":%s 403 %s %s :No such channel\n",server_name,t->nickname,name);
+    return -1;
+  }
+
+  pthread_rwlock_wrlock(&channels_lock);
+  struct channel *c=channel_find(name);
+  if (c&&channel_membership(t,c)) {
+    pthread_rwlock_unlock(&channels_lock);
+    return 0;
+  }
+  struct membership *m=calloc(sizeof(struct membership),1);
+  if (!m) {
+    pthread_rwlock_unlock(&channels_lock);
+    return -1;
+  }
+  if (!c) {
+    c=calloc(sizeof(struct channel),1);
+    if (!c) {
+      pthread_rwlock_unlock(&channels_lock);
+      free(m);
+      return -1;
+    }
+    strcpy(c->name,name);
+    channel_fold(c->folded,name);
+    unsigned int b=nick_hash(c->folded)&(CHANNEL_BUCKETS-1);
+    c->next=channel_table[b];
+    channel_table[b]=c;
+    channel_count++;
+  }
+  if (c->member_count>=c->size) {
+    int size=c->size?c->size*2:8;
+    struct membership **members=realloc(c->members,size*sizeof(struct membership *));
+    if (!members) {
+      pthread_rwlock_unlock(&channels_lock);
+      free(m);
+      return -1;
+    }
+    c->members=members;
+    c->size=size;
+  }
+  m->channel=c;
+  m->client=t;
+  strcpy(m->nick,t->nickname);
+  m->index=c->member_count;
+  c->members[c->member_count++]=m;
+  m->next=t->channels;
+  t->channels=m;
+
+  // the other members hear about it through their inboxes, we get told
+  // straight away so that the names list follows the JOIN
+  if (!quiet) {
+    snprintf(msg,1024,":%s!myusername@myserver JOIN %s\n",t->nickname,c->name);
+    channel_send(c,t,msg);
+    output_append(t,msg,strlen(msg));
+    channel_names(t,c);
+  }
+  pthread_rwlock_unlock(&channels_lock);
+  return 0;
+}
+
+// removes a membership, and the channel too if that was its last member.
+// caller must hold channels_lock as a writer.
+void channel_remove(struct client_thread *t,struct membership *m) {
+  struct channel *c=m->channel;
+  struct membership **p=&t->channels;
+  while(*p!=m) p=&(*p)->next;
+  *p=m->next;
+
+  c->members[m->index]=c->members[--c->member_count];
+  c->members[m->index]->index=m->index;
+  free(m);
+
+  if (!c->member_count) {
+    struct channel **cp=&channel_table[nick_hash(c->folded)&(CHANNEL_BUCKETS-1)];
+    while(*cp!=c) cp=&(*cp)->next;
+    *cp=c->next;
+    free(c->members);
+    free(c);
+    channel_count--;
+  }
+}
+
+int channel_part(struct client_thread *t,char *name) {
+  char msg[1024];
+  pthread_rwlock_wrlock(&channels_lock);
+  struct channel *c=channel_find(name);
+  struct membership *m=c?channel_membership(t,c):NULL;
+  if (!m) {
+    pthread_rwlock_unlock(&channels_lock);
+    if (!c) output_printf(t,":%s 403 %s %s :No such channel\n",server_name,t->nickname,name);
+    else output_printf(t,":%s 442 %s %s :You're not on that channel\n",server_name,t->nickname,name);
+    return -1;
+  }
+  snprintf(msg,1024,":%s!myusername@myserver PART %s\n",t->nickname,c->name);
+  channel_send(c,t,msg);
+  output_append(t,msg,strlen(msg));
+  channel_remove(t,m);
+  pthread_rwlock_unlock(&channels_lock);
+  return 0;
+}
+
+void channel_part_all(struct client_thread *t) {
+  if (!t->channels) return;
+  pthread_rwlock_wrlock(&channels_lock);
+  while(t->channels) channel_remove(t,t->channels);
+  pthread_rwlock_unlock(&channels_lock);
+}
+
+// keeps the nickname in our memberships up to date after NICK
+void channel_rename(struct client_thread *t) {
+  if (!t->channels) return;
+  pthread_rwlock_wrlock(&channels_lock);
+  struct membership *m;
+  for(m=t->channels;m;m=m->next) strcpy(m->nick,t->nickname);
+  pthread_rwlock_unlock(&channels_lock);
+}
+
+// sends a message to everyone else on a channel we are on
+int channel_privmsg(struct client_thread *t,char *name,char *message) {
+  pthread_rwlock_rdlock(&channels_lock);
+  struct channel *c=channel_find(name);
+  if (!c) {
+    pthread_rwlock_unlock(&channels_lock);
+    output_printf(t,":%s 401 %s %s :No such nick/channel\n",server_name,t->nickname,name);
+    return -1;
+  }
+  if (!channel_membership(t,c)) {
+    pthread_rwlock_unlock(&channels_lock);
+    output_printf(t,":%s 404 %s %s :Cannot send to channel\n",server_name,t->nickname,name);
+    return -1;
+  }
+  char line[2048];
+  snprintf(line,2048,":%s!myusername@myserver PRIVMSG %s :%s\n",t->nickname,c->name,message);
+  channel_send(c,t,line);
+  pthread_rwlock_unlock(&channels_lock);
+  return 0;
+}
+
+int channel_names_command(struct client_thread *t,char *name) {
+  pthread_rwlock_rdlock(&channels_lock);
+  struct channel *c=channel_find(name);
+  if (c) channel_names(t,c);
+  else {
+    output_printf(t,":%s 366 %s %s :End of NAMES list\n",server_name,t->nickname,name);
+  }
+  pthread_rwlock_unlock(&channels_lock);
+  return 0;
+}
+
+int create_listen_socket(int port,int reuse_port)
+{
+  int sock = socket(AF_INET,SOCK_STREAM,0);
+  if (sock==-1) return -1;
+
+  int on=1;
+  if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (char *)&on, sizeof(on)) == -1) {
+    close(sock); return -1;
+  }
+  if (reuse_port&&setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (char *)&on, sizeof(on)) == -1) {
+    close(sock); return -1;
+  }
+  if (ioctl(sock, FIONBIO, (char *)&on) == -1) {
+    close(sock); return -1;
+  }
+  
+  /* Bind it to the next port we want to try. */
+  struct sockaddr_in address;
+  bzero((char *) &address, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = INADDR_ANY;
+  address.sin_port = htons(port);
+  if (bind(sock, (struct sockaddr *) &address, sizeof(address)) == -1) {
+    close(sock); return -1;
+  } 
+
+  if (listen(sock, listen_backlog) != -1) return sock;
+
+  close(sock);
+  return -1;
+}
+
+// everything we write is already batched into whole replies, so there is
+// nothing to gain from Nagle holding the tail of one back for an ACK
+void client_socket_options(int sock)
+{
+  int on=1;
+  setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char *)&on, sizeof(on));
+}
+
+// file descriptors kept back from connections: listening sockets, the
+// workers' epoll and eventfds, the journal and stdio
+int connection_fds_reserved(void) {
+  return 32+4*reactor_count;
+}
+
+// how many connections the open file limit leaves room for. in thread mode
+// each one has an eventfd as well as its socket. the limit is looked at
+// again once a second, so raising it with prlimit takes effect at once.
+int fd_limit_clients=INT_MAX;
+time_t fd_limit_checked=0;
+
+int connection_fd_limit(void) {
+  time_t now=time(NULL);
+  if (now!=__atomic_load_n(&fd_limit_checked,__ATOMIC_RELAXED)) {
+    struct rlimit rl;
+    if (!getrlimit(RLIMIT_NOFILE,&rl)&&rl.rlim_cur!=RLIM_INFINITY) {
+      long long n=((long long)rl.rlim_cur-connection_fds_reserved())/(server_mode==MODE_THREADS?2:1);
+      __atomic_store_n(&fd_limit_clients,n<0?0:n>INT_MAX?INT_MAX:n,__ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&fd_limit_checked,now,__ATOMIC_RELAXED);
+  }
+  return __atomic_load_n(&fd_limit_clients,__ATOMIC_RELAXED);
+}
+
+// raises the open file limit as far as we may if -c needs more, and warns
+// if it still leaves room for fewer clients than that
+void connection_limit_init(void) {
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE,&rl)) return;
+  rlim_t want=(rlim_t)max_clients*(server_mode==MODE_THREADS?2:1)+connection_fds_reserved();
+  if (rl.rlim_cur!=RLIM_INFINITY&&rl.rlim_cur<want) {
+    rl.rlim_cur=rl.rlim_max!=RLIM_INFINITY&&rl.rlim_max<want?rl.rlim_max:want;
+    setrlimit(RLIMIT_NOFILE,&rl);
+  }
+  fd_limit_checked=0;
+  int n=connection_fd_limit();
+  if (n<max_clients)
+    fprintf(stderr,"The open file limit only leaves room for %d clients\n",n);
+}
+
+// takes a place for a connection that has just been accepted.
+// returns -1 if we already have as many as we allow.
+int connection_admit(void) {
+  int limit=__atomic_load_n(&max_clients,__ATOMIC_RELAXED);
+  int fds=connection_fd_limit();
+  if (fds<limit) limit=fds;
+  int n=__atomic_load_n(&connections_open,__ATOMIC_RELAXED);
+  do {
+    if (n>=limit) {
+      stat_add(&stats()->rejected,1);
+      return -1;
+    }
+  } while(!__atomic_compare_exchange_n(&connections_open,&n,n+1,1,__ATOMIC_RELAXED,__ATOMIC_RELAXED));
+  return 0;
+}
+
+void connection_closed(void) {
+  __atomic_sub_fetch(&connections_open,1,__ATOMIC_RELAXED);
+}
+
+// turns away a socket we have no place for, without allocating anything
+void connection_reject(int sock) {
+  static const char msg[]="ERROR :Closing Link: Client count too great\n";
+  stat_syscall();
+  write(sock,msg,sizeof(msg)-1);
+  close(sock);
+}
+
+int accept_incoming(int sock)
+{
+  struct sockaddr addr;
+  unsigned int addr_len = sizeof addr;
+  int asock;
+  stat_syscall();
+  if ((asock = accept(sock, &addr, &addr_len)) != -1) {
+    return asock;
+  }
+
+  return -1;
+}
+
+// a line split up following the RFC 2812 message grammar. the fields all
+// point into the line itself, which is cut up in place rather than copied.
+#define MAX_PARAMS 15
+
+struct message {
+  char *prefix;
+  char *command;
+  // hash of the command in upper case, for looking it up
+  unsigned int command_hash;
+  char *params[MAX_PARAMS];
+  int param_count;
+};
+
+int line_end(char c) {
+  return !c||c=='\r'||c=='\n';
+}
+
+// splits line into m in a single pass. a trailing parameter (one starting
+// with ':', or the fifteenth) takes the rest of the line, spaces and all.
+// returns -1 if there is no command.
+int message_parse(char *line,struct message *m) {
+  char *p=line;
+  m->prefix=NULL;
+  m->param_count=0;
+
+  if (*p==':') {
+    m->prefix=++p;
+    while(*p!=' '&&!line_end(*p)) p++;
+    if (*p!=' ') return -1;
+    *p++=0;
+    while(*p==' ') p++;
+  }
+
+  m->command=p;
+  unsigned int h=2166136261u;
+  while(*p!=' '&&!line_end(*p)) {
+    unsigned char c=*p++;
+    if (c>='a'&&c<='z') c-='a'-'A';
+    h^=c; h*=16777619u;
+  }
+  if (p==m->command) return -1;
+  m->command_hash=h;
+
+  while(*p==' ') {
+    *p++=0;
+    while(*p==' ') p++;
+    if (line_end(*p)) break;
+    if (*p==':'||m->param_count==MAX_PARAMS-1) {
+      if (*p==':') p++;
+      m->params[m->param_count++]=p;
+      while(!line_end(*p)) p++;
+      break;
+    }
+    m->params[m->param_count++]=p;
+    while(*p!=' '&&!line_end(*p)) p++;
+  }
+  *p=0;
+  return 0;
+}
+
+// says why we are closing the connection, and closes it.
+// returns -1, for parse_line to pass on.
+int client_quit(struct client_thread *t,const char *reason) {
+  // if we dont close the connection, we will get a SIGPIPE that will kill our program
+  // when we try to read from the socket again in the loop.
+  output_printf(t,"ERROR :Closing Link: %s\n",reason);
+  // in io_uring mode the socket may still be in use by the kernel, so the
+  // worker closes it once that is finished
+  if (t->uring) return -1;
+  output_flush(t);
+  client_timer_stop(t);
+  close(t->fd);
+  connection_closed();
+  return -1;
+}
+
+int command_quit(struct client_thread *t,struct message *m) {
+  // client has said they are going away
+  return client_quit(t,"User quit");
+}
+
+// links to other servers, after RFC 2813 but only as much of it as it
+// takes to pass private messages around. a link is an ordinary connection
+// that has sent SERVER instead of registering; it then hears about every
+// server and nickname we know of, and we of everything it knows. servers
+// and nicknames learnt from one link are passed on to all the others, and
+// a server we already know of is refused, so the links always form a
+// spanning tree and there is only ever one way to a nickname. channels
+// are not shared between servers.
+#define LINK_TIMEOUT 60
+#define LINK_RETRY_S 5
+
+pthread_mutex_t servers_lock = PTHREAD_MUTEX_INITIALIZER;
+struct server *servers=NULL;
+// servers linked to us directly, so that with none nothing need be locked
+int link_count=0;
+int link_peer_up[MAX_LINK_PEERS];
+
+// caller must hold servers_lock
+struct server *server_find_locked(const char *name) {
+  struct server *s;
+  for(s=servers;s;s=s->next)
+    if (!strcasecmp(s->name,name)) return s;
+  return NULL;
+}
+
+// caller must hold servers_lock
+struct server *server_add_locked(const char *name,int hops,struct server *uplink,
+                                 struct client_thread *link) {
+  struct server *s=calloc(sizeof(struct server),1);
+  if (!s) return NULL;
+  snprintf(s->name,64,"%s",name);
+  s->hops=hops;
+  s->uplink=uplink;
+  s->link=link;
+  struct server **p=&servers;
+  while(*p) p=&(*p)->next;
+  *p=s;
+  if (!uplink) __atomic_add_fetch(&link_count,1,__ATOMIC_RELAXED);
+  return s;
+}
+
+// queues a line for a connection from any thread
+void link_send(struct client_thread *t,const char *fmt,...) {
+  char line[2048];
+  va_list ap;
+  va_start(ap,fmt);
+  vsnprintf(line,2048,fmt,ap);
+  va_end(ap);
+  struct shared_message *sm=shared_message_new(line);
+  if (!sm) return;
+  struct mail *m=mail_new(sm,clock_ns());
+  shared_message_release(sm);
+  if (!m) return;
+  inbox_push(&t->inbox,m);
+  client_notify(t);
+}
+
+// queues line for every server linked to us other than skip.
+// caller must hold servers_lock.
+void link_broadcast_line(struct client_thread *skip,const char *line) {
+  struct shared_message *sm=NULL;
+  long long now=clock_ns();
+  struct server *s;
+  for(s=servers;s;s=s->next) {
+    if (s->uplink||s->link==skip) continue;
+    if (!sm&&!(sm=shared_message_new(line))) return;
+    struct mail *m=mail_new(sm,now);
+    if (!m) continue;
+    inbox_push(&s->link->inbox,m);
+    client_notify(s->link);
+  }
+  if (sm) shared_message_release(sm);
+}
+
+void link_broadcast(struct client_thread *skip,const char *fmt,...) {
+  if (!__atomic_load_n(&link_count,__ATOMIC_RELAXED)) return;
+  char line[2048];
+  va_list ap;
+  va_start(ap,fmt);
+  vsnprintf(line,2048,fmt,ap);
+  va_end(ap);
+  pthread_mutex_lock(&servers_lock);
+  link_broadcast_line(skip,line);
+  pthread_mutex_unlock(&servers_lock);
+}
+
+// adds a nickname on server s. returns -1 if it is already in use.
+// caller must hold servers_lock.
+int remote_user_add_locked(struct server *s,const char *nick) {
+  char folded[32];
+  nick_fold(folded,nick);
+  unsigned int h=nick_hash(folded);
+  pthread_mutex_t *l=nick_lock(h);
+  pthread_mutex_lock(l);
+  if (nick_find_locked(folded,h)||remote_find_locked(folded,h)) {
+    pthread_mutex_unlock(l);
+    return -1;
+  }
+  struct remote_user *u=calloc(sizeof(struct remote_user),1);
+  if (!u) {
+    pthread_mutex_unlock(l);
+    return -1;
+  }
+  snprintf(u->nickname,32,"%s",nick);
+  strcpy(u->folded_nick,folded);
+  u->server=s;
+  u->nick_next=remote_table[h&(NICK_BUCKETS-1)];
+  remote_table[h&(NICK_BUCKETS-1)]=u;
+  pthread_mutex_unlock(l);
+  u->next=s->users;
+  if (s->users) s->users->prev=u;
+  s->users=u;
+  return 0;
+}
+
+// caller must hold servers_lock
+void remote_user_remove_locked(struct remote_user *u) {
+  unsigned int h=nick_hash(u->folded_nick);
+  pthread_mutex_t *l=nick_lock(h);
+  pthread_mutex_lock(l);
+  struct remote_user **p=&remote_table[h&(NICK_BUCKETS-1)];
+  while(*p&&*p!=u) p=&(*p)->nick_next;
+  if (*p) *p=u->nick_next;
+  pthread_mutex_unlock(l);
+  if (u->prev) u->prev->next=u->next; else u->server->users=u->next;
+  if (u->next) u->next->prev=u->prev;
+  free(u);
+}
+
+// finds a nickname on a server behind link t.
+// caller must hold servers_lock.
+struct remote_user *remote_user_find_locked(struct client_thread *t,const char *nick) {
+  char folded[32];
+  nick_fold(folded,nick);
+  unsigned int h=nick_hash(folded);
+  pthread_mutex_t *l=nick_lock(h);
+  pthread_mutex_lock(l);
+  struct remote_user *u=remote_find_locked(folded,h);
+  pthread_mutex_unlock(l);
+  return u&&u->server->link==t?u:NULL;
+}
+
+// forgets s, the servers it introduced and everyone on all of them.
+// caller must hold servers_lock.
+void server_remove_locked(struct server *s) {
+  struct server **p=&servers;
+  while(*p) {
+    if ((*p)->uplink==s) {
+      server_remove_locked(*p);
+      p=&servers;
+    } else p=&(*p)->next;
+  }
+  while(s->users) remote_user_remove_locked(s->users);
+  for(p=&servers;*p!=s;p=&(*p)->next);
+  *p=s->next;
+  if (!s->uplink) __atomic_sub_fetch(&link_count,1,__ATOMIC_RELAXED);
+  free(s);
+}
+
+// called as a link closes. nothing can be sent to it once this returns.
+void link_lost(struct client_thread *t) {
+  pthread_mutex_lock(&servers_lock);
+  char line[256];
+  snprintf(line,256,":%s SQUIT %s :Link closed\n",server_name,t->server->name);
+  server_remove_locked(t->server);
+  t->server=NULL;
+  link_broadcast_line(NULL,line);
+  pthread_mutex_unlock(&servers_lock);
+}
+
+// tells a new link about everything we know, other than what is behind it.
+// we are its connection's own thread, so can write to its output.
+// caller must hold servers_lock.
+void link_burst(struct client_thread *t) {
+  struct server *s;
+  for(s=servers;s;s=s->next) {
+    if (s->link==t) continue;
+    output_printf(t,":%s SERVER %s %d :%s\n",s->uplink?s->uplink->name:server_name,
+                  s->name,s->hops+1,s->name);
+  }
+  int b;
+  for(b=0;b<NICK_BUCKETS;b++) {
+    if (!nick_table[b]&&!remote_table[b]) continue;
+    pthread_mutex_t *l=nick_lock(b);
+    pthread_mutex_lock(l);
+    struct client_thread *c;
+    for(c=nick_table[b];c;c=c->nick_next)
+      if (c->user_has_registered)
+        output_printf(t,"NICK %s 1 myusername myserver %s + :%s\n",c->nickname,server_name,c->nickname);
+    struct remote_user *u;
+    for(u=remote_table[b];u;u=u->nick_next)
+      if (u->server->link!=t)
+        output_printf(t,"NICK %s %d myusername myserver %s + :%s\n",u->nickname,
+                      u->server->hops+1,u->server->name,u->nickname);
+    pthread_mutex_unlock(l);
+  }
+}
+
+// compares a password given to us with ours in time that only depends on
+// the lengths, so how long the reply takes says nothing about how much of
+// a guess was right
+int password_matches(char *given,char *password) {
+  size_t given_len=strlen(given),len=strlen(password),i;
+  unsigned char diff=given_len!=len;
+  for(i=0;i<given_len;i++) diff|=given[i]^password[i<len?i:0];
+  return !diff;
+}
+
+// PASS comes before SERVER from a server linking to us, or answering us.
+// ours is only sent back once SERVER has checked theirs.
+int command_pass(struct client_thread *t,struct message *m) {
+  t->link_authorised=link_password&&link_password[0]&&password_matches(m->params[0],link_password);
+  return 0;
+}
+
+// SERVER from a connection that has not registered: it is another server
+// linking to us, or answering us linking to it. only one that has given
+// the link password may.
+int command_server(struct client_thread *t,struct message *m) {
+  if (t->user_command_seen||t->nickname[0]) {
+    output_printf(t,":%s 462 %s :You may not reregister\n",server_name,t->nickname[0]?t->nickname:"*");
+    return 0;
+  }
+  if (!t->link_authorised) return client_quit(t,"Bad password");
+  char *name=m->params[0];
+  pthread_mutex_lock(&servers_lock);
+  if (!strcasecmp(name,server_name)||server_find_locked(name)) {
+    pthread_mutex_unlock(&servers_lock);
+    return client_quit(t,"Server already linked");
+  }
+  struct server *s=server_add_locked(name,1,NULL,t);
+  if (!s) {
+    pthread_mutex_unlock(&servers_lock);
+    return client_quit(t,"Out of memory");
+  }
+  t->server=s;
+  t->timeout=LINK_TIMEOUT;
+  if (!t->linking) output_printf(t,"PASS %s\nSERVER %s 1 :%s\n",link_password,server_name,server_name);
+  t->linking=0;
+  link_burst(t);
+  char line[256];
+  snprintf(line,256,":%s SERVER %s 2 :%s\n",server_name,s->name,s->name);
+  link_broadcast_line(t,line);
+  pthread_mutex_unlock(&servers_lock);
+  return 0;
+}
+
+// a server further away, introduced by prefix
+int link_server(struct client_thread *t,struct message *m) {
+  pthread_mutex_lock(&servers_lock);
+  if (!strcasecmp(m->params[0],server_name)||server_find_locked(m->params[0])) {
+    // we can already reach it, so this link would make a loop
+    pthread_mutex_unlock(&servers_lock);
+    return client_quit(t,"Server already linked");
+  }
+  struct server *uplink=m->prefix?server_find_locked(m->prefix):NULL;
+  if (!uplink||uplink->link!=t) uplink=t->server;
+  int hops=atoi(m->params[1]);
+  struct server *s=server_add_locked(m->params[0],hops>0?hops:2,uplink,t);
+  if (s) {
+    char line[256];
+    snprintf(line,256,":%s SERVER %s %d :%s\n",uplink->name,s->name,s->hops+1,s->name);
+    link_broadcast_line(t,line);
+  }
+  pthread_mutex_unlock(&servers_lock);
+  return 0;
+}
+
+// a server behind the link has split off
+int link_squit(struct client_thread *t,struct message *m) {
+  pthread_mutex_lock(&servers_lock);
+  struct server *s=server_find_locked(m->params[0]);
+  if (s==t->server) {
+    pthread_mutex_unlock(&servers_lock);
+    return client_quit(t,"Link closed");
+  }
+  if (s&&s->link==t) {
+    char line[256];
+    snprintf(line,256,":%s SQUIT %s :%s\n",server_name,s->name,
+             m->param_count>1?m->params[1]:"Link closed");
+    server_remove_locked(s);
+    link_broadcast_line(t,line);
+  }
+  pthread_mutex_unlock(&servers_lock);
+  return 0;
+}
+
+// kills whoever has nick here: our own client is sent the KILL and closes,
+// and a KILL goes toward the server of someone further away. either way
+// the QUIT as they leave tells every server they have gone.
+// caller must hold servers_lock, so that a remote user stays put.
+void nick_kill_locked(const char *nick,struct client_thread *skip) {
+  char folded[32],line[256];
+  nick_fold(folded,nick);
+  unsigned int h=nick_hash(folded);
+  pthread_mutex_t *l=nick_lock(h);
+  snprintf(line,256,":%s KILL %s :Nick collision\n",server_name,nick);
+  pthread_mutex_lock(l);
+  struct client_thread *c=nick_find_locked(folded,h);
+  struct remote_user *u=c?NULL:remote_find_locked(folded,h);
+  if (c&&!__atomic_load_n(&c->killed,__ATOMIC_RELAXED)) {
+    // the KILL goes in first, so the client sees it before the ERROR
+    struct shared_message *sm=shared_message_new(line);
+    struct mail *m=sm?mail_new(sm,clock_ns()):NULL;
+    if (sm) shared_message_release(sm);
+    if (m) inbox_push(&c->inbox,m);
+    __atomic_store_n(&c->killed,1,__ATOMIC_RELEASE);
+    client_notify(c);
+  }
+  pthread_mutex_unlock(l);
+  if (u&&u->server->link!=skip) link_send(u->server->link,"%s",line);
+}
+
+// a nickname coming into use behind the link, or one there changing
+int link_nick(struct client_thread *t,struct message *m) {
+  char *nick=m->params[0];
+  if (!nick[0]||strlen(nick)>=32||strchr(nick,'!')) return 0;
+  char line[256];
+  pthread_mutex_lock(&servers_lock);
+  if (m->param_count>=5) {
+    struct server *s=server_find_locked(m->params[4]);
+    if (s&&s->link==t) {
+      if (!remote_user_add_locked(s,nick)) {
+        snprintf(line,256,"NICK %s %d myusername myserver %s + :%s\n",nick,s->hops+1,s->name,nick);
+        link_broadcast_line(t,line);
+      } else {
+        // two servers gave the nickname out before hearing of each other,
+        // as when they are linked. which came first cannot be agreed on,
+        // so as in RFC 2812 both holders are killed: ours here, and theirs
+        // by a KILL back down the link. the other side does the same.
+        nick_kill_locked(nick,t);
+        link_send(t,":%s KILL %s :Nick collision\n",server_name,nick);
+      }
+    }
+  } else if (m->prefix) {
+    struct remote_user *u=remote_user_find_locked(t,m->prefix);
+    char folded[32];
+    nick_fold(folded,nick);
+    if (u&&!strcmp(folded,u->folded_nick)) {
+      // only the case has changed
+      pthread_mutex_t *l=nick_lock(nick_hash(folded));
+      pthread_mutex_lock(l);
+      snprintf(line,256,":%s NICK %s\n",u->nickname,nick);
+      snprintf(u->nickname,32,"%s",nick);
+      pthread_mutex_unlock(l);
+      link_broadcast_line(t,line);
+    } else if (u) {
+      snprintf(line,256,":%s NICK %s\n",u->nickname,nick);
+      if (!remote_user_add_locked(u->server,nick)) {
+        remote_user_remove_locked(u);
+        link_broadcast_line(t,line);
+      } else {
+        // taken here, though not where they are. they keep the old nickname
+        // here, and the KILL takes them off their own server, whose QUIT
+        // for the new one then removes them everywhere
+        snprintf(u->renamed,32,"%s",nick);
+        link_send(t,":%s KILL %s :Nick collision\n",server_name,nick);
+      }
+    }
+  }
+  pthread_mutex_unlock(&servers_lock);
+  return 0;
+}
+
+// a KILL from a server that found the nickname in use twice. it is passed
+// toward whoever has it, and never back the way it came.
+int link_kill(struct client_thread *t,struct message *m) {
+  pthread_mutex_lock(&servers_lock);
+  nick_kill_locked(m->params[0],t);
+  pthread_mutex_unlock(&servers_lock);
+  return 0;
+}
+
+// finds a user behind link t whose change to nick clashed here, so that we
+// still know them by their old one. caller must hold servers_lock.
+struct remote_user *remote_user_renamed_locked(struct client_thread *t,const char *nick) {
+  char folded[32],renamed[32];
+  nick_fold(folded,nick);
+  struct server *s;
+  struct remote_user *u;
+  for(s=servers;s;s=s->next) {
+    if (s->link!=t) continue;
+    for(u=s->users;u;u=u->next) {
+      if (!u->renamed[0]) continue;
+      nick_fold(renamed,u->renamed);
+      if (!strcmp(renamed,folded)) return u;
+    }
+  }
+  return NULL;
+}
+
+int link_quit(struct client_thread *t,struct message *m) {
+  if (!m->prefix) return 0;
+  pthread_mutex_lock(&servers_lock);
+  struct remote_user *u=remote_user_find_locked(t,m->prefix);
+  if (!u) u=remote_user_renamed_locked(t,m->prefix);
+  if (u) {
+    char line[256];
+    snprintf(line,256,":%s QUIT :%s\n",u->nickname,m->param_count?m->params[0]:"");
+    remote_user_remove_locked(u);
+    link_broadcast_line(t,line);
+  }
+  pthread_mutex_unlock(&servers_lock);
+  return 0;
+}
+
+// whether the sender in prefix, nick!user@host, is someone behind link t.
+// a remote user and their server stay put while we hold the lock on their
+// nickname, since both are only removed under it.
+int link_sender_check(struct client_thread *t,const char *prefix) {
+  char nick[32],folded[32];
+  int len=strcspn(prefix,"!");
+  if (!len||len>=32) return 0;
+  memcpy(nick,prefix,len);
+  nick[len]=0;
+  nick_fold(folded,nick);
+  unsigned int h=nick_hash(folded);
+  pthread_mutex_t *l=nick_lock(h);
+  pthread_mutex_lock(l);
+  struct remote_user *u=remote_find_locked(folded,h);
+  int ok=u&&u->server->link==t;
+  pthread_mutex_unlock(l);
+  return ok;
+}
+
+// a private message from someone behind the link, for someone here or
+// further on. a line claiming to be from anyone else is dropped.
+int link_privmsg(struct client_thread *t,struct message *m) {
+  if (!m->prefix||!link_sender_check(t,m->prefix)) return 0;
+  char *nicks[MAX_TARGETS],*missing[MAX_TARGETS];
+  int count=0;
+  char *save;
+  char *target=strtok_r(m->params[0],",",&save);
+  for(;target&&count<MAX_TARGETS;target=strtok_r(NULL,",",&save))
+    if (target[0]!='#'&&target[0]!='&') nicks[count++]=target;
+  if (count) privmsg_send(m->prefix,nicks,count,m->params[1],t,missing);
+  return 0;
+}
+
+int link_ping(struct client_thread *t,struct message *m) {
+  output_printf(t,":%s PONG %s :%s\n",server_name,server_name,m->param_count?m->params[0]:server_name);
+  return 0;
+}
+
+// nothing to do: hearing anything at all keeps the link up
+int link_pong(struct client_thread *t,struct message *m) {
+  return 0;
+}
+
+int link_error(struct client_thread *t,struct message *m) {
+  return client_quit(t,"Link closed");
+}
+
+// the targets may be a list separated by commas. channels are sent to one
+// at a time, and all the nicknames share a single line.
+int command_privmsg(struct client_thread *t,struct message *m) {
+  char *message=m->params[1];
+  char *nicks[MAX_TARGETS],*missing[MAX_TARGETS];
+  int count=0,i;
+  char *save;
+  char *target=strtok_r(m->params[0],",",&save);
+  for(;target;target=strtok_r(NULL,",",&save)) {
+    if (target[0]=='#'||target[0]=='&')
+      channel_privmsg(t,target,message);
+    else if (count<MAX_TARGETS)
+      nicks[count++]=target;
+    else
+      output_printf(t,":%s 407 %s %s :Too many recipients\n",server_name,t->nickname,target);
+  }
+  if (!count) return 0;
+  char sender[1024];
+  snprintf(sender,1024,"%s!myusername@myserver",t->nickname);
+  trace_begin();
+  int missed=privmsg_send(sender,nicks,count,message,NULL,missing);
+  trace_read=0;
+  for(i=0;i<missed;i++)
+    output_printf(t,":%s 401 %s %s :No such nick/channel\n",server_name,t->nickname,missing[i]);
+  return 0;
+}
+
+int command_join(struct client_thread *t,struct message *m) {
+  if (!strcmp(m->params[0],"0")) {
+    // JOIN 0 leaves every channel we are on
+    while(t->channels) {
+      char name[MAX_CHANNEL_NAME+1];
+      strcpy(name,t->channels->channel->name);
+      channel_part(t,name);
+    }
+    return 0;
+  }
+  char *save;
+  char *name=strtok_r(m->params[0],",",&save);
+  while(name) {
+    channel_join(t,name,0);
+    name=strtok_r(NULL,",",&save);
+  }
+  return 0;
+}
+
+int command_part(struct client_thread *t,struct message *m) {
+  char *save;
+  char *name=strtok_r(m->params[0],",",&save);
+  while(name) {
+    channel_part(t,name);
+    name=strtok_r(NULL,",",&save);
+  }
+  return 0;
+}
+
+int command_names(struct client_thread *t,struct message *m) {
+  char *save;
+  char *name=strtok_r(m->params[0],",",&save);
+  while(name) {
+    channel_names_command(t,name);
+    name=strtok_r(NULL,",",&save);
+  }
+  return 0;
+}
+
+int command_nick(struct client_thread *t,struct message *m) {
+  char *nickname=m->params[0];
+  if (!nickname[0]) {
+    output_printf(t,":%s 431 %s :No nickname given\n",server_name,t->nickname[0]?t->nickname:"*");
+  } else if (strlen(nickname)<32) {
+    char old[32];
+    strcpy(old,t->nickname);
+    if (!nick_claim(t,nickname)) {
+      channel_rename(t);
+      if (t->user_has_registered) link_broadcast(NULL,":%s NICK %s\n",old,t->nickname);
+      registration_check(t);
+    } else {
+      output_printf(t,":%s 433 %s %s :Nickname is already in use\n",server_name,
+                    t->nickname[0]?t->nickname:"*",nickname);
+    }
+  } else {
+    output_printf(t,":%s 432 : Nickname too long\n",server_name);
+  }
+  return 0;
+}
+
+int command_user(struct client_thread *t,struct message *m) {
+  t->user_command_seen=1;
+  registration_check(t);
+  return 0;
+}
+
+// writes out the totals of all the counters a line at a time
+void stats_report(void (*emit)(void *context,const char *line),void *context) {
+  struct stats total;
+  stats_total(&total);
+  char line[256];
+  snprintf(line,256,"connections %d, rejected %lld, channels %d",
+           __atomic_load_n(&connections_open,__ATOMIC_RELAXED),total.rejected,channel_count);
+  emit(context,line);
+  snprintf(line,256,"messages appended %lld, delivered %lld",total.appended,total.delivered);
+  emit(context,line);
+  int i,records=0;
+  for(i=0;i<POOL_CLASSES;i++) records+=__atomic_load_n(&pool_slabs[i].chunks,__ATOMIC_RELAXED);
+  snprintf(line,256,"slab chunks mapped for connections %d, records %d",
+           __atomic_load_n(&client_slab.chunks,__ATOMIC_RELAXED),records);
+  emit(context,line);
+  if (journal_dir) {
+    snprintf(line,256,"journal messages recovered %lld",journal_restored);
+    emit(context,line);
+  }
+  snprintf(line,256,"bytes in %lld, out %lld",total.bytes_in,total.bytes_out);
+  emit(context,line);
+  snprintf(line,256,"parse errors %lld",total.parse_errors);
+  emit(context,line);
+  snprintf(line,256,"message log lock waited for %lld times, %lld us in all",
+           total.lock_waits,total.lock_wait_ns/1000);
+  emit(context,line);
+  snprintf(line,256,"sendq lines dropped %lld, connections closed %lld",
+           total.sendq_drops,total.sendq_kills);
+  emit(context,line);
+  snprintf(line,256,"flood control waits %lld, connections closed %lld",
+           total.flood_waits,total.flood_kills);
+  emit(context,line);
+  snprintf(line,256,"system calls %lld",total.syscalls);
+  emit(context,line);
+  snprintf(line,256,"delivery latency p50 <= %lld us, p99 <= %lld us, p999 <= %lld us",
+           stats_percentile(&total,0.5),stats_percentile(&total,0.99),
+           stats_percentile(&total,0.999));
+  emit(context,line);
+  if (!trace_rate) return;
+  long long latency[TRACE_STAGES][STATS_BUCKETS];
+  snprintf(line,256,"traced events %lld",trace_histograms(latency));
+  emit(context,line);
+  for(i=0;i<TRACE_STAGES;i++) {
+    snprintf(line,256,"trace %s p50 <= %lld us, p99 <= %lld us, p999 <= %lld us",trace_stages[i],
+             histogram_percentile(latency[i],0.5),histogram_percentile(latency[i],0.99),
+             histogram_percentile(latency[i],0.999));
+    emit(context,line);
+  }
+}
+
+void stats_reply(void *context,const char *line) {
+  struct client_thread *t=context;
+  output_printf(t,":%s 249 %s :%s\n",server_name,t->nickname,line);
+}
+
+int command_stats(struct client_thread *t,struct message *m) {
+  stats_report(stats_reply,t);
+  output_printf(t,":%s 219 %s %s :End of STATS report\n",server_name,
+                t->nickname,m->param_count?m->params[0]:"*");
+  return 0;
+}
+
+// the commands we understand, looked up by the hash the parser works out.
+// registered commands are refused with a 241 until registration is done.
+// links to other servers have a set of commands of their own.
+#define COMMAND_BUCKETS 32
+
+struct command {
+  const char *name;
+  int (*handler)(struct client_thread *t,struct message *m);
+  int min_params;
+  int registered;
+  int link;
+  unsigned int hash;
+  struct command *next;
+};
+
+// link is 0 for what a client may send, and 1 for what another server
+// may send over a link; neither may use the other's commands
+struct command commands[]={
+  {.name="QUIT",.handler=command_quit,.min_params=0,.registered=0,.link=0},
+  {.name="PRIVMSG",.handler=command_privmsg,.min_params=2,.registered=1,.link=0},
+  {.name="JOIN",.handler=command_join,.min_params=1,.registered=1,.link=0},
+  {.name="PART",.handler=command_part,.min_params=1,.registered=1,.link=0},
+  {.name="NAMES",.handler=command_names,.min_params=1,.registered=1,.link=0},
+  {.name="NICK",.handler=command_nick,.min_params=1,.registered=0,.link=0},
+  {.name="USER",.handler=command_user,.min_params=1,.registered=0,.link=0},
+  {.name="STATS",.handler=command_stats,.min_params=0,.registered=1,.link=0},
+  {.name="PASS",.handler=command_pass,.min_params=1,.registered=0,.link=0},
+  {.name="SERVER",.handler=command_server,.min_params=2,.registered=0,.link=0},
+  {.name="SERVER",.handler=link_server,.min_params=2,.registered=0,.link=1},
+  {.name="SQUIT",.handler=link_squit,.min_params=1,.registered=0,.link=1},
+  {.name="NICK",.handler=link_nick,.min_params=1,.registered=0,.link=1},
+  {.name="QUIT",.handler=link_quit,.min_params=0,.registered=0,.link=1},
+  {.name="KILL",.handler=link_kill,.min_params=1,.registered=0,.link=1},
+  {.name="PRIVMSG",.handler=link_privmsg,.min_params=2,.registered=0,.link=1},
+  {.name="PING",.handler=link_ping,.min_params=0,.registered=0,.link=1},
+  {.name="PONG",.handler=link_pong,.min_params=0,.registered=0,.link=1},
+  {.name="ERROR",.handler=link_error,.min_params=0,.registered=0,.link=1},
+  {.name=NULL}
+};
+
+struct command *command_table[COMMAND_BUCKETS];
+
+void command_table_init(void) {
+  struct command *c;
+  for(c=commands;c->name;c++) {
+    c->hash=nick_hash(c->name);
+    c->next=command_table[c->hash%COMMAND_BUCKETS];
+    command_table[c->hash%COMMAND_BUCKETS]=c;
+  }
+}
+
+struct command *command_find(struct message *m,int link) {
+  struct command *c;
+  for(c=command_table[m->command_hash%COMMAND_BUCKETS];c;c=c->next)
+    if (c->hash==m->command_hash&&c->link==link&&!strcasecmp(c->name,m->command)) return c;
+  return NULL;
+}
+
+// handles one line from the client. returns -1 if the connection has been
+// closed.
+int parse_line(struct client_thread *t, char *buffer) {
+  struct message m;
+  if (message_parse(buffer,&m)) {
+    stat_add(&stats()->parse_errors,1);
+    return 0;
+  }
+
+  // anything we do not know about is ignored
+  struct command *c=command_find(&m,t->server!=NULL);
+  if (!c) return 0;
+
+  if (c->registered&&!t->user_has_registered) {
+    output_printf(t,":%s 241 * : %s command sent before registration\n",server_name,c->name);
+    return 0;
+  }
+  if (m.param_count<c->min_params) {
+    stat_add(&stats()->parse_errors,1);
+    output_printf(t,":%s 461 %s : Mal-formed %s command sent\n",server_name,
+                  t->nickname[0]?t->nickname:"*",c->name);
+    return 0;
+  }
+  return c->handler(t,&m);
+}
+
+// charges a line of len bytes to the client's flood control buckets.
+// returns 0 if it may go ahead, otherwise how many ns it has to wait, and
+// charges nothing.
+long long flood_check(struct client_thread *t,int len,long long now) {
+  long long burst=FLOOD_BURST_MS*1000000LL;
+  // the longest line has to fit in the byte bucket
+  long long byte_burst=flood_bytes?LINE_SIZE*1000000000LL/flood_bytes:0;
+  if (byte_burst<burst) byte_burst=burst;
+  long long lines=t->flood_line_clock>now?t->flood_line_clock:now;
+  long long bytes=t->flood_byte_clock>now?t->flood_byte_clock:now;
+  if (flood_lines) lines+=1000000000LL/flood_lines;
+  if (flood_bytes) bytes+=len*1000000000LL/flood_bytes;
+  long long wait=lines-now-burst;
+  if (bytes-now-byte_burst>wait) wait=bytes-now-byte_burst;
+  if (wait>0) return wait;
+  t->flood_line_clock=lines;
+  t->flood_byte_clock=bytes;
+  return 0;
+}
+
+// keeps input to come back to once the client may send again. returns -1
+// if that is too much, and the connection has been closed.
+int flood_hold(struct client_thread *t,unsigned char *data,int len) {
+  if (t->held_len+len>t->held_size) {
+    int size=t->held_size?t->held_size:1024;
+    while(size<t->held_len+len) size*=2;
+    unsigned char *held=size>FLOOD_HELD_MAX?NULL:pool_realloc(t->held,t->held_size,size);
+    if (!held) {
+      stat_add(&stats()->flood_kills,1);
+      return client_quit(t,"Excess Flood");
+    }
+    t->held=held;
+    t->held_size=size;
+    __atomic_store_n(&t->holding,1,__ATOMIC_RELAXED);
+  }
+  memcpy(&t->held[t->held_len],data,len);
+  t->held_len+=len;
+  return 0;
+}
+
+int client_input(struct client_thread *t,unsigned char *buffer,int length);
+
+// carries on with the input held back for a client once its wait is over.
+// returns -1 if a line closed the connection.
+int flood_resume(struct client_thread *t) {
+  unsigned char *held=t->held;
+  int len=t->held_len,size=t->held_size;
+  t->held=NULL;
+  t->held_len=t->held_size=0;
+  __atomic_store_n(&t->holding,0,__ATOMIC_RELAXED);
+  int r=client_input(t,held,len);
+  pool_free(held,size);
+  return r;
+}
+
+// splits what has been read into lines and handles each one. a connection
+// only holds a line buffer while part of a line has arrived without its
+// end. returns -1 if a line closed the connection.
+int client_input(struct client_thread *t,unsigned char *buffer,int length) {
+  // nothing new is looked at while earlier input is held back
+  if (t->held) return flood_hold(t,buffer,length);
+  long long now=(flood_lines||flood_bytes)&&!t->server?clock_ns():0;
+  int i;
+  for(i=0;i<length;i++) {
+    if (buffer[i]=='\n'||buffer[i]=='\r') {
+      if (t->line_len>0) {
+        // a link is only let off once it has given the password
+        long long wait=now&&!t->server?flood_check(t,t->line_len+1,now):0;
+        if (wait) {
+          // the line stays where it is, and its end is held with the rest
+          stat_add(&stats()->flood_waits,1);
+          t->flood_until=now+wait;
+          return flood_hold(t,&buffer[i],length-i);
+        }
+        if (trace_rate) trace_input=clock_ns();
+        if (parse_line(t,t->line)==-1) return -1;
+      }
+      t->line_len=0;
+    } else if (t->line_len<LINE_SIZE-1) {
+      if (!t->line&&!(t->line=pool_alloc(LINE_SIZE))) continue;
+      t->line[t->line_len++]=buffer[i];
+      t->line[t->line_len]=0;
+    }
+  }
+  if (!t->line_len) client_line_release(t);
+  return 0;
+}
+
+// connection threads need room for one read and the deepest command, not
+// the default of several megabytes each
+#define CONNECTION_STACK (128*1024)
+pthread_attr_t connection_attr;
+
+void connection_attr_init(void) {
+  pthread_attr_init(&connection_attr);
+  pthread_attr_setstacksize(&connection_attr,CONNECTION_STACK);
+}
+
+// runs a connection that has already been admitted
+void *handle_connection(void *data) {
+  struct client_thread *t=data;
+  pthread_detach(pthread_self());
+  connection(t);
+  client_unregister(t);
+  // nobody can wake us now that we are unregistered
+  if (t->wakefd!=-1) close(t->wakefd);
+  slab_free(t);
+  return 0;
+}
+
+int connection(struct client_thread *t) {
+  int fd=t->fd;
+  t->timeout=REGISTRATION_TIMEOUT;
+  fcntl(fd,F_SETFL,fcntl(fd,F_GETFL,NULL)|O_NONBLOCK);
+  client_socket_options(fd);
+  t->wakefd=eventfd(0,EFD_NONBLOCK);
+  unsigned char buffer[8192];
+  int length=0;
+  struct pollfd fds[2];
+
+  if (!t->linking) output_printf(t,":%s 020 * :gday m8\n",server_name);
+  output_flush(t);
+
+  // the timer shuts down our side of the socket if we go idle for too long
+  client_timer_start(t,&client_timers);
+
+  // should test for t->fd>=0 instead of 1
+  while(1){
+    // checks for messages for user in log
+    inbox_read(t);
+
+    // sleep until the client sends something, we are told about new mail,
+    // or there is room for output that did not fit last time. without an
+    // eventfd we have to fall back to looking every second. a client
+    // that flood control is holding back is not read from until its
+    // wait is over.
+    int wait=t->wakefd==-1?1000:-1;
+    if (t->held) {
+      long long left=t->flood_until-clock_ns();
+      wait=left>0?(left+999999)/1000000:0;
+    }
+    fds[0].fd=fd;
+    fds[0].events=(t->held?0:POLLIN)|(t->output.count?POLLOUT:0);
+    fds[1].fd=t->wakefd;
+    fds[1].events=POLLIN;
+    stat_syscall();
+    if (poll(fds,2,wait)==-1) continue;
+    if (fds[1].revents&POLLIN) {
+      uint64_t v;
+      stat_syscall();
+      read(t->wakefd,&v,sizeof(v));
+      __atomic_store_n(&t->wake_pending,0,__ATOMIC_SEQ_CST);
+    }
+    if (fds[0].revents&POLLOUT) output_flush(t);
+    if (t->held&&clock_ns()>=t->flood_until) {
+      if (flood_resume(t)) return 0;
+      output_flush(t);
+      continue;
+    }
+    if (!(fds[0].revents&(POLLIN|POLLHUP|POLLERR))) continue;
+
+    stat_syscall();
+    length=read(fd,buffer,sizeof(buffer)-1);
+    if (length==-1&&(errno==EAGAIN||errno==EINTR)) continue;
+    if (length<=0) {
+      client_timer_stop(t);
+      if (t->timed_out) {
+        output_printf(t,"ERROR :Closing Link: Connection timed out length=0\n");
+        output_flush(t);
+      }
+      close(fd);
+      connection_closed();
+      return 0;
+    }
+    buffer[length]=0;
+    stat_add(&stats()->bytes_in,length);
+    t->time_of_last_data=timer_clock();
+    // parse each line, and exit the function if one closes the connection
+    if (client_input(t,buffer,length)) return 0;
+    // send all the replies to what we just read in one go
+    output_flush(t);
+  }
+  close(fd);
+  return 0;
+}
+
+// checks if the user has sent both USER and NICK commands
+// then sends user confirmation of connection
+int registration_check(struct client_thread *t) 
+{
+  if (t->user_has_registered) return -1;
+  if (t->user_command_seen&&t->nickname[0]) {
+    // User has now met the registration requirements
+    t->user_has_registered=1;
+    t->timeout=idle_timeout;
+    client_timer_reset(t);
+    if (journal_dir) journal_redeliver(t);
+    link_broadcast(NULL,"NICK %s 1 myusername myserver %s + :%s\n",t->nickname,server_name,t->nickname);
+    output_printf(t,":%s 001 %s : Gday\n",server_name,t->nickname);
+    output_printf(t,":%s 002 %s : mate.\n",server_name,t->nickname);
+    output_printf(t,":%s 003 %s : Welcome\n",server_name,t->nickname);
+    output_printf(t,":%s 004 %s : to the server.\n",server_name,t->nickname);
+    output_printf(t,":%s 253 %s : some unknown connections\n",server_name,t->nickname);
+    output_printf(t,":%s 254 %s %d :channels formed.\n",server_name,t->nickname,channel_count);
+    output_printf(t,":%s 255 %s : I have %i clients and some servers.\n",server_name,t->nickname,
+                  __atomic_load_n(&connections_open,__ATOMIC_RELAXED));
+    return 0;
+  }
+  return -1;
+}
+
+// reactor mode: a fixed set of worker threads, each with its own epoll
+// instance, drives every connection.  sockets are non-blocking and
+// registered edge-triggered, so a worker reads until EAGAIN each time.
+#define REACTOR_EVENTS 256
+// most connections a worker accepts from its own socket before it gets on
+// with servicing the ones it has
+#define REACTOR_ACCEPT_BATCH 64
+// how often a worker wakes while it has timers running
+#define REACTOR_TICK_MS 1000
+
+struct reactor {
+  pthread_t thread;
+  int id;
+  int epfd;
+  // in io_uring mode, used instead of epfd
+  struct uring *ring;
+  // our own listening socket when reuseport is set, otherwise -1
+  int listen_fd;
+  // in io_uring mode, whether the accept on it is still outstanding
+  int accepting;
+
+  // eventfd used by the acceptor to hand over new connections, and by
+  // other threads to say that some of our connections have new mail
+  int wakefd;
+
+  // both lists are protected by pending_lock
+  pthread_mutex_t pending_lock;
+  struct client_thread *pending;
+  struct client_thread *ready;
+
+  // connections owned by this worker
+  struct client_thread *clients;
+  int client_count;
+
+  // connections waiting for flood control to let them carry on
+  struct client_thread *flooding;
+
+  struct timer_wheel timers;
+};
+
+struct reactor *reactors=NULL;
+
+void reactor_unlink(struct reactor *r,struct client_thread *t) {
+  if (t->prev) t->prev->next=t->next; else r->clients=t->next;
+  if (t->next) t->next->prev=t->prev;
+  t->prev=t->next=NULL;
+  r->client_count--;
+}
+
+// forget about a connection whose socket has already been closed
+void reactor_release(struct client_thread *t) {
+  struct reactor *r=t->reactor;
+  if (t->flood_listed) {
+    struct client_thread **p=&r->flooding;
+    while(*p&&*p!=t) p=&(*p)->flood_next;
+    if (*p) *p=t->flood_next;
+    t->flood_listed=0;
+  }
+  client_unregister(t);
+  // nobody can notify us any more, but we may still be on the ready list
+  if (t->wake_pending) {
+    pthread_mutex_lock(&r->pending_lock);
+    struct client_thread **p=&r->ready;
+    while(*p&&*p!=t) p=&(*p)->ready_next;
+    if (*p) *p=t->ready_next;
+    pthread_mutex_unlock(&r->pending_lock);
+  }
+  reactor_unlink(r,t);
+  slab_free(t);
+}
+
+// called by client_notify from any thread
+void reactor_notify(struct client_thread *t) {
+  struct reactor *r=t->reactor;
+  pthread_mutex_lock(&r->pending_lock);
+  int idle=!r->ready;
+  t->ready_next=r->ready;
+  r->ready=t;
+  pthread_mutex_unlock(&r->pending_lock);
+  if (idle) {
+    uint64_t v=1;
+    stat_syscall();
+    write(r->wakefd,&v,sizeof(v));
+  }
+}
+
+void uring_close(struct client_thread *t,char *reason);
+
+void reactor_close(struct client_thread *t,char *reason) {
+  if (t->uring) {
+    uring_close(t,reason);
+    return;
+  }
+  if (reason) {
+    output_printf(t,"ERROR :Closing Link: %s\n",reason);
+    output_flush(t);
+  }
+  close(t->fd);
+  connection_closed();
+  reactor_release(t);
+}
+
+void reactor_add(struct reactor *r,struct client_thread *t);
+void uring_add(struct client_thread *t);
+void flood_wait(struct client_thread *t);
+
+// take ownership of connections passed over by the acceptor, and deliver
+// mail to connections that have been notified
+void reactor_wake(struct reactor *r) {
+  uint64_t v;
+  stat_syscall();
+  read(r->wakefd,&v,sizeof(v));
+
+  pthread_mutex_lock(&r->pending_lock);
+  struct client_thread *list=r->pending;
+  struct client_thread *ready=r->ready;
+  r->pending=NULL;
+  r->ready=NULL;
+  pthread_mutex_unlock(&r->pending_lock);
+
+  while(ready) {
+    struct client_thread *t=ready;
+    ready=t->ready_next;
+    // clear the flag before looking, so that mail arriving while we read
+    // wakes us again
+    __atomic_store_n(&t->wake_pending,0,__ATOMIC_SEQ_CST);
+    inbox_read(t);
+  }
+
+  while(list) {
+    struct client_thread *t=list;
+    list=t->next;
+    reactor_add(r,t);
+  }
+}
+
+// start servicing a new connection
+void reactor_add(struct reactor *r,struct client_thread *t) {
+  t->prev=NULL;
+  t->next=r->clients;
+  if (r->clients) r->clients->prev=t;
+  r->clients=t;
+  r->client_count++;
+
+  t->timeout=t->user_has_registered?idle_timeout:REGISTRATION_TIMEOUT;
+  client_timer_start(t,&r->timers);
+
+  if (!t->linking&&!t->restored) output_printf(t,":%s 020 * :gday m8\n",server_name);
+  if (t->held) flood_wait(t);
+  if (r->ring) {
+    uring_add(t);
+    return;
+  }
+  output_flush(t);
+
+  // EPOLLOUT tells us when a socket that filled up has room again
+  struct epoll_event ev;
+  ev.events=EPOLLIN|EPOLLOUT|EPOLLRDHUP|EPOLLET;
+  ev.data.ptr=t;
+  if (epoll_ctl(r->epfd,EPOLL_CTL_ADD,t->fd,&ev)==-1) {
+    perror("epoll_ctl() failed to add client");
+    reactor_close(t,NULL);
+  }
+}
+
+// puts a connection that flood control has stopped on its worker's list
+void flood_wait(struct client_thread *t) {
+  struct reactor *r=t->reactor;
+  if (t->flood_listed) return;
+  t->flood_listed=1;
+  t->flood_next=r->flooding;
+  r->flooding=t;
+}
+
+// how long a worker may sleep, at most wait ms, before a connection's
+// flood control wait is over
+int flood_timeout(struct reactor *r,int wait) {
+  if (!r->flooding) return wait;
+  long long now=clock_ns(),until=LLONG_MAX;
+  struct client_thread *t;
+  for(t=r->flooding;t;t=t->flood_next)
+    if (t->flood_until<until) until=t->flood_until;
+  long long ms=until>now?(until-now+999999)/1000000:0;
+  return wait==-1||ms<wait?ms:wait;
+}
+
+void reactor_resume(struct client_thread *t);
+void uring_resume(struct client_thread *t);
+
+// carries on with every connection whose wait is over
+void flood_run(struct reactor *r) {
+  long long now=clock_ns();
+  struct client_thread **p=&r->flooding;
+  while(*p) {
+    struct client_thread *t=*p;
+    if (t->flood_until>now) { p=&t->flood_next; continue; }
+    *p=t->flood_next;
+    t->flood_listed=0;
+    if (r->ring) uring_resume(t); else reactor_resume(t);
+  }
+}
+
+// parses each complete line in what has just been read.
+// returns -1 if it included a QUIT.
+int reactor_input(struct client_thread *t,unsigned char *buffer,int length) {
+  stat_add(&stats()->bytes_in,length);
+  t->time_of_last_data=timer_clock();
+  int held=t->held!=NULL;
+  if (client_input(t,buffer,length)) return -1;
+  if (!held&&t->held) flood_wait(t);
+  return 0;
+}
+
+// drain everything the socket has for us, parsing each complete line.
+// returns -1 if the connection has gone away.
+int reactor_read(struct client_thread *t) {
+  unsigned char buffer[8192];
+  while(1) {
+    stat_syscall();
+    int length=read(t->fd,buffer,sizeof(buffer));
+    if (length==-1) {
+      if (errno==EAGAIN||errno==EWOULDBLOCK) break;
+      if (errno==EINTR) continue;
+      reactor_close(t,NULL);
+      return -1;
+    }
+    if (length==0) {
+      reactor_close(t,NULL);
+      return -1;
+    }
+    if (reactor_input(t,buffer,length)) {
+      // QUIT has already closed the socket
+      reactor_release(t);
+      return -1;
+    }
+  }
+  // send all the replies to what we just read in one go
+  if (output_flush(t)) {
+    reactor_close(t,NULL);
+    return -1;
+  }
+  return 0;
+}
+
+// edge-triggered epoll will not tell us again about what arrived while
+// flood control held a connection back, so read it once the wait is over
+void reactor_resume(struct client_thread *t) {
+  if (flood_resume(t)) {
+    reactor_release(t);
+    return;
+  }
+  if (!t->held) {
+    reactor_read(t);
+    return;
+  }
+  flood_wait(t);
+  if (output_flush(t)) reactor_close(t,NULL);
+}
+
+// writes out whatever is queued for a socket that has room again
+int reactor_write(struct client_thread *t) {
+  if (output_flush(t)) {
+    reactor_close(t,NULL);
+    return -1;
+  }
+  return 0;
+}
+
+// makes a connection for a freshly accepted non-blocking socket, unless
+// we already have as many clients as we allow
+struct client_thread *reactor_client_new(struct reactor *r,int client_sock) {
+  if (connection_admit()) {
+    connection_reject(client_sock);
+    return NULL;
+  }
+  struct client_thread *t=client_new(client_sock);
+  if (!t) {
+    close(client_sock);
+    connection_closed();
+    return NULL;
+  }
+  client_socket_options(client_sock);
+  t->reactor=r;
+  return t;
+}
+
+// accept whatever is waiting on our own listening socket
+void reactor_accept(struct reactor *r) {
+  int i;
+  for(i=0;i<REACTOR_ACCEPT_BATCH;i++) {
+    stat_syscall();
+    int client_sock=accept4(r->listen_fd,NULL,NULL,SOCK_NONBLOCK);
+    if (client_sock==-1) {
+      if (errno==EINTR||errno==ECONNABORTED) continue;
+      // EAGAIN, or out of file descriptors: try again when epoll says so
+      return;
+    }
+    struct client_thread *t=reactor_client_new(r,client_sock);
+    if (t) reactor_add(r,t);
+  }
+}
+
+void handover_park(void);
+
+void *reactor_loop(void *data) {
+  struct reactor *r=data;
+  struct epoll_event events[REACTOR_EVENTS];
+
+  while(1) {
+    if (__atomic_load_n(&handover_started,__ATOMIC_ACQUIRE)) handover_park();
+    // with no timers to run there is nothing to do until something happens
+    stat_syscall();
+    int n=epoll_wait(r->epfd,events,REACTOR_EVENTS,
+                     flood_timeout(r,r->timers.count?REACTOR_TICK_MS:-1));
+    if (n==-1&&errno!=EINTR) {
+      perror("epoll_wait() failed");
+      usleep(10000);
+    }
+    int i;
+    for(i=0;i<n;i++) {
+      struct client_thread *t=events[i].data.ptr;
+      if (!t) { reactor_wake(r); continue; }
+      if (events[i].data.ptr==r) { reactor_accept(r); continue; }
+      if (events[i].events&EPOLLOUT&&t->output.count&&reactor_write(t)) continue;
+      if (events[i].events&(EPOLLIN|EPOLLRDHUP|EPOLLHUP|EPOLLERR)&&!t->held) reactor_read(t);
+    }
+    flood_run(r);
+
+    // close whichever connections have been idle too long
+    timer_advance(&r->timers,timer_clock());
+  }
+  return NULL;
+}
+
+int reactor_dispatch(int client_sock);
+
+// io_uring mode: the reactor workers drive their connections through an
+// io_uring each instead of epoll. every connection has a multishot receive
+// outstanding that takes buffers from a ring the worker provides, each
+// worker's listening socket (or the shared one, on the first worker) has
+// a multishot accept, and output goes out as a chain of linked sendmsgs
+// that the kernel finishes before telling us. one io_uring_enter submits
+// everything and collects what has completed.
+#define URING_ENTRIES 1024
+#define URING_BUFFERS 512
+#define URING_BUFFER_SIZE 4096
+// iovecs in one sendmsg, and most sendmsgs in one linked chain
+#define URING_SEND_IOVECS 1024
+#define URING_SEND_CHAIN 8
+
+// what a completion is for, kept in the low bits of its user_data
+#define URING_ACCEPT 1
+#define URING_WAKE 2
+#define URING_RECV 3
+#define URING_SEND 4
+#define URING_CANCEL 5
+#define URING_KIND 7
+
+// the setup flags we want; a worker may only be driven by itself
+#define URING_SETUP_FLAGS (IORING_SETUP_SINGLE_ISSUER|IORING_SETUP_DEFER_TASKRUN|\
+                           IORING_SETUP_SUBMIT_ALL|IORING_SETUP_CQSIZE)
+
+struct uring {
+  int fd;
+  unsigned *sq_head,*sq_tail,*sq_mask,*sq_array;
+  unsigned sq_entries;
+  // SQEs filled in but not yet handed to the kernel end here
+  unsigned sqe_tail;
+  struct io_uring_sqe *sqes;
+  unsigned *cq_head,*cq_tail,*cq_mask;
+  struct io_uring_cqe *cqes;
+
+  // buffers for receives to pick from
+  struct io_uring_buf_ring *buf_ring;
+  char *buffers;
+  unsigned short buf_tail;
+};
+
+// a connection's sends. output is moved here when it is handed to the
+// kernel, so that replies can keep collecting in the connection's own
+// output without moving what the kernel is reading.
+struct uring_conn {
+  struct output sending;
+  // first segment of sending not yet in a sendmsg
+  int sent;
+  // only held while a send is under way
+  struct iovec *iov;
+  struct msghdr *msg;
+  int iov_size;
+  // sendmsgs outstanding, and whether any of them failed
+  int sends;
+  int send_failed;
+  int recv_armed;
+  // the receive has been asked to stop, for flood control
+  int recv_cancelled;
+  int closing;
+  // a traced delivery waiting in the output, and one in the send under
+  // way, recorded when the send completes
+  struct trace_event traced;
+  struct trace_event tracing;
+};
+
+int uring_setup_ring(struct uring *u,int ring_fd,struct io_uring_params *p) {
+  u->fd=ring_fd;
+  size_t sq_size=p->sq_off.array+p->sq_entries*sizeof(unsigned);
+  size_t cq_size=p->cq_off.cqes+p->cq_entries*sizeof(struct io_uring_cqe);
+  size_t size=sq_size>cq_size?sq_size:cq_size;
+  char *ring=mmap(NULL,size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,ring_fd,IORING_OFF_SQ_RING);
+  if (ring==MAP_FAILED) return -1;
+  u->sqes=mmap(NULL,p->sq_entries*sizeof(struct io_uring_sqe),PROT_READ|PROT_WRITE,
+               MAP_SHARED|MAP_POPULATE,ring_fd,IORING_OFF_SQES);
+  if (u->sqes==MAP_FAILED) return -1;
+  u->sq_head=(unsigned *)(ring+p->sq_off.head);
+  u->sq_tail=(unsigned *)(ring+p->sq_off.tail);
+  u->sq_mask=(unsigned *)(ring+p->sq_off.ring_mask);
+  u->sq_array=(unsigned *)(ring+p->sq_off.array);
+  u->sq_entries=p->sq_entries;
+  u->sqe_tail=*u->sq_tail;
+  u->cq_head=(unsigned *)(ring+p->cq_off.head);
+  u->cq_tail=(unsigned *)(ring+p->cq_off.tail);
+  u->cq_mask=(unsigned *)(ring+p->cq_off.ring_mask);
+  u->cqes=(struct io_uring_cqe *)(ring+p->cq_off.cqes);
+  unsigned i;
+  for(i=0;i<u->sq_entries;i++) u->sq_array[i]=i;
+  return 0;
+}
+
+int uring_create(struct io_uring_params *p) {
+  memset(p,0,sizeof(struct io_uring_params));
+  p->flags=URING_SETUP_FLAGS;
+  p->cq_entries=URING_ENTRIES*4;
+  int fd=syscall(__NR_io_uring_setup,URING_ENTRIES,p);
+  if (fd==-1) return -1;
+  // we need one mapping for both rings, and waits that time out
+  if (!(p->features&IORING_FEAT_SINGLE_MMAP)||!(p->features&IORING_FEAT_EXT_ARG)) {
+    close(fd);
+    errno=ENOSYS;
+    return -1;
+  }
+  return fd;
+}
+
+// can we have an io_uring set up the way we want it?
+int uring_available(void) {
+  struct io_uring_params p;
+  int fd=uring_create(&p);
+  if (fd==-1) return 0;
+  close(fd);
+  return 1;
+}
+
+void uring_buffer_add(struct uring *u,int id) {
+  struct io_uring_buf *b=&u->buf_ring->bufs[u->buf_tail&(URING_BUFFERS-1)];
+  b->addr=(uintptr_t)&u->buffers[id*URING_BUFFER_SIZE];
+  b->len=URING_BUFFER_SIZE;
+  b->bid=id;
+  u->buf_tail++;
+  __atomic_store_n(&u->buf_ring->tail,u->buf_tail,__ATOMIC_RELEASE);
+}
+
+// must run on the worker thread, which is then the only one that may use
+// the ring
+struct uring *uring_new(void) {
+  struct io_uring_params p;
+  struct uring *u=calloc(sizeof(struct uring),1);
+  if (!u) return NULL;
+  int fd=uring_create(&p);
+  if (fd==-1||uring_setup_ring(u,fd,&p)) return NULL;
+
+  u->buf_ring=mmap(NULL,URING_BUFFERS*sizeof(struct io_uring_buf),PROT_READ|PROT_WRITE,
+                   MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+  u->buffers=malloc(URING_BUFFERS*URING_BUFFER_SIZE);
+  if (u->buf_ring==MAP_FAILED||!u->buffers) return NULL;
+  struct io_uring_buf_reg reg;
+  memset(&reg,0,sizeof(reg));
+  reg.ring_addr=(uintptr_t)u->buf_ring;
+  reg.ring_entries=URING_BUFFERS;
+  reg.bgid=0;
+  if (syscall(__NR_io_uring_register,fd,IORING_REGISTER_PBUF_RING,&reg,1)) return NULL;
+  int i;
+  for(i=0;i<URING_BUFFERS;i++) uring_buffer_add(u,i);
+  return u;
+}
+
+// hands over the SQEs filled in so far and, if wait_ms is not -2, waits
+// up to wait_ms (forever if -1) for at least one completion
+int uring_enter(struct uring *u,int wait_ms) {
+  unsigned submit=u->sqe_tail-*u->sq_tail;
+  __atomic_store_n(u->sq_tail,u->sqe_tail,__ATOMIC_RELEASE);
+  unsigned flags=0,wait=0;
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  memset(&arg,0,sizeof(arg));
+  if (wait_ms!=-2) {
+    flags|=IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG;
+    wait=1;
+    if (wait_ms>=0) {
+      ts.tv_sec=wait_ms/1000;
+      ts.tv_nsec=(wait_ms%1000)*1000000LL;
+      arg.ts=(uintptr_t)&ts;
+    }
+  }
+  stat_syscall();
+  return syscall(__NR_io_uring_enter,u->fd,submit,wait,flags,wait?&arg:NULL,sizeof(arg));
+}
+
+// returns a cleared SQE, making room for count of them in a row first so
+// that a linked chain goes to the kernel in one piece
+struct io_uring_sqe *uring_sqe(struct uring *u,int count) {
+  while(u->sqe_tail+count-__atomic_load_n(u->sq_head,__ATOMIC_ACQUIRE)>u->sq_entries)
+    if (uring_enter(u,-2)==-1&&errno!=EINTR&&errno!=EAGAIN&&errno!=EBUSY) break;
+  struct io_uring_sqe *sqe=&u->sqes[u->sqe_tail&*u->sq_mask];
+  memset(sqe,0,sizeof(struct io_uring_sqe));
+  u->sqe_tail++;
+  return sqe;
+}
+
+void uring_accept(struct reactor *r) {
+  struct io_uring_sqe *sqe=uring_sqe(r->ring,1);
+  sqe->opcode=IORING_OP_ACCEPT;
+  sqe->fd=r->listen_fd;
+  sqe->ioprio=IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags=SOCK_NONBLOCK;
+  sqe->user_data=(uintptr_t)r|URING_ACCEPT;
+  r->accepting=1;
+}
+
+void uring_wake(struct reactor *r) {
+  struct io_uring_sqe *sqe=uring_sqe(r->ring,1);
+  sqe->opcode=IORING_OP_POLL_ADD;
+  sqe->fd=r->wakefd;
+  sqe->len=IORING_POLL_ADD_MULTI;
+  sqe->poll32_events=POLLIN;
+  sqe->user_data=(uintptr_t)r|URING_WAKE;
+}
+
+void uring_recv(struct client_thread *t) {
+  struct io_uring_sqe *sqe=uring_sqe(t->reactor->ring,1);
+  sqe->opcode=IORING_OP_RECV;
+  sqe->fd=t->fd;
+  sqe->ioprio=IORING_RECV_MULTISHOT;
+  sqe->flags=IOSQE_BUFFER_SELECT;
+  sqe->buf_group=0;
+  sqe->user_data=(uintptr_t)t|URING_RECV;
+  t->uring->recv_armed=1;
+  t->uring->recv_cancelled=0;
+}
+
+// stops the multishot receive, so that the kernel leaves whatever else the
+// client sends in the socket while flood control holds it back
+void uring_recv_cancel(struct client_thread *t) {
+  struct uring_conn *uc=t->uring;
+  if (!uc->recv_armed||uc->recv_cancelled) return;
+  struct io_uring_sqe *sqe=uring_sqe(t->reactor->ring,1);
+  sqe->opcode=IORING_OP_ASYNC_CANCEL;
+  sqe->fd=-1;
+  sqe->addr=(uintptr_t)t|URING_RECV;
+  sqe->user_data=URING_CANCEL;
+  uc->recv_cancelled=1;
+}
+
+// sends the next lot of what is being sent, as one linked chain. MSG_WAITALL
+// has the kernel carry on until all of each sendmsg is written, so a chain
+// only stops short if the connection fails. flags is added to each sendmsg.
+void uring_send_chain(struct client_thread *t,int flags) {
+  struct uring_conn *uc=t->uring;
+  struct output *o=&uc->sending;
+  int count=o->count-uc->sent;
+  if (count>URING_SEND_IOVECS*URING_SEND_CHAIN) count=URING_SEND_IOVECS*URING_SEND_CHAIN;
+  if (count>uc->iov_size) {
+    int size=uc->iov_size?uc->iov_size*2:8;
+    while(size<count) size*=2;
+    struct iovec *iov=pool_realloc(uc->iov,uc->iov_size*sizeof(struct iovec),size*sizeof(struct iovec));
+    if (!iov) { uc->send_failed=1; return; }
+    uc->iov=iov;
+    uc->iov_size=size;
+  }
+  if (!uc->msg&&!(uc->msg=pool_alloc(URING_SEND_CHAIN*sizeof(struct msghdr)))) {
+    uc->send_failed=1;
+    return;
+  }
+  int i;
+  for(i=0;i<count;i++) {
+    struct output_segment *s=&o->segments[uc->sent+i];
+    uc->iov[i].iov_base=(s->shared?s->shared->data:o->buf)+s->offset;
+    uc->iov[i].iov_len=s->len;
+  }
+  uc->sent+=count;
+
+  int n=(count+URING_SEND_IOVECS-1)/URING_SEND_IOVECS;
+  for(i=0;i<n;i++) {
+    struct msghdr *msg=&uc->msg[i];
+    memset(msg,0,sizeof(struct msghdr));
+    msg->msg_iov=&uc->iov[i*URING_SEND_IOVECS];
+    msg->msg_iovlen=i<n-1?URING_SEND_IOVECS:count-i*URING_SEND_IOVECS;
+    struct io_uring_sqe *sqe=uring_sqe(t->reactor->ring,n-i);
+    sqe->opcode=IORING_OP_SENDMSG;
+    sqe->fd=t->fd;
+    sqe->addr=(uintptr_t)msg;
+    sqe->msg_flags=MSG_NOSIGNAL|flags;
+    if (i<n-1) sqe->flags=IOSQE_IO_LINK;
+    sqe->user_data=(uintptr_t)t|URING_SEND;
+  }
+  uc->sends=n;
+}
+
+// hands the connection's output to the kernel, swapping in the buffers of
+// the last send, which are empty
+void uring_send(struct client_thread *t,int flags) {
+  struct uring_conn *uc=t->uring;
+  struct output o=uc->sending;
+  uc->sending=t->output;
+  t->output=o;
+  uc->sent=0;
+  uc->tracing=uc->traced;
+  uc->traced.at[0]=0;
+  uring_send_chain(t,flags);
+}
+
+// keeps a traced delivery with the output it is in, so that it is written
+// when that has been sent
+void uring_trace(struct client_thread *t,struct trace_event *e) {
+  struct uring_conn *uc=t->uring;
+  if (!uc->traced.at[0]) uc->traced=*e;
+}
+
+// starts sending whatever output has collected, unless a send is already
+// under way, in which case it goes when that has finished. this is what
+// output_flush does in io_uring mode.
+int uring_flush(struct client_thread *t) {
+  struct uring_conn *uc=t->uring;
+  // once a handover has begun, new output goes with the connection
+  if (uc->sends||!t->output.count||uc->closing||
+      __atomic_load_n(&handover_started,__ATOMIC_ACQUIRE)) return 0;
+  uring_send(t,MSG_WAITALL);
+  return 0;
+}
+
+// closes a connection that nothing is outstanding for any more
+void uring_finish(struct client_thread *t) {
+  struct uring_conn *uc=t->uring;
+  if (!uc->closing||uc->sends||uc->recv_armed) return;
+  close(t->fd);
+  connection_closed();
+  output_free(&uc->sending);
+  pool_free(uc->msg,URING_SEND_CHAIN*sizeof(struct msghdr));
+  pool_free(uc->iov,uc->iov_size*sizeof(struct iovec));
+  free(uc);
+  t->uring=NULL;
+  reactor_release(t);
+}
+
+// reactor_close for io_uring mode. the socket cannot be closed while the
+// kernel has requests for it, so shut it down to end them and close it
+// when the last one has completed.
+void uring_close(struct client_thread *t,char *reason) {
+  struct uring_conn *uc=t->uring;
+  if (uc->closing) return;
+  if (reason) output_printf(t,"ERROR :Closing Link: %s\n",reason);
+  client_timer_stop(t);
+  if (uc->sends) {
+    // a send that has not finished may never finish, so give up on it
+    shutdown(t->fd,SHUT_RDWR);
+  } else {
+    // one last try at sending what is left, if there is room for it
+    if (t->output.count) uring_send(t,MSG_DONTWAIT);
+    shutdown(t->fd,SHUT_RD);
+  }
+  uc->closing=1;
+  uring_finish(t);
+}
+
+void uring_send_done(struct client_thread *t,int res) {
+  struct uring_conn *uc=t->uring;
+  if (res<0) uc->send_failed=1;
+  if (--uc->sends) return;
+  if (!uc->send_failed&&!uc->closing&&uc->sent<uc->sending.count) {
+    uring_send_chain(t,MSG_WAITALL);
+    return;
+  }
+  // everything handed over has gone, so let go of it
+  if (uc->tracing.at[0]&&!uc->send_failed) {
+    struct trace_event *e=&uc->tracing;
+    trace_record(TRACE_DELIVERY,e->at[0],e->at[1],e->at[2],clock_ns());
+  }
+  uc->tracing.at[0]=0;
+  struct output *o=&uc->sending;
+  int i;
+  for(i=0;i<o->count;i++)
+    if (o->segments[i].shared) shared_message_release(o->segments[i].shared);
+  o->count=0;
+  o->queued=0;
+  output_release(o);
+  pool_free(uc->msg,URING_SEND_CHAIN*sizeof(struct msghdr));
+  uc->msg=NULL;
+  pool_free(uc->iov,uc->iov_size*sizeof(struct iovec));
+  uc->iov=NULL;
+  uc->iov_size=0;
+  if (uc->closing) { uring_finish(t); return; }
+  if (uc->send_failed) { uring_close(t,NULL); return; }
+  uring_flush(t);
+}
+
+void uring_recv_done(struct client_thread *t,int res,unsigned flags) {
+  struct uring_conn *uc=t->uring;
+  struct uring *u=t->reactor->ring;
+  if (!(flags&IORING_CQE_F_MORE)) uc->recv_armed=0;
+  if (res>0) {
+    int id=flags>>IORING_CQE_BUFFER_SHIFT;
+    int quit=uc->closing?0:reactor_input(t,(unsigned char *)&u->buffers[id*URING_BUFFER_SIZE],res);
+    uring_buffer_add(u,id);
+    if (quit) { uring_close(t,NULL); return; }
+    if (uc->closing) { uring_finish(t); return; }
+    // send all the replies to what we just read in one go
+    uring_flush(t);
+    if (t->held||handover_started) uring_recv_cancel(t);
+    else if (!uc->recv_armed) uring_recv(t);
+    return;
+  }
+  // out of buffers: they have all been given back by now, so try again.
+  // a receive stopped for flood control is started again once the wait is
+  // over.
+  if ((res==-ENOBUFS||res==-ECANCELED)&&!uc->closing) {
+    if (!uc->recv_armed&&!t->held&&!handover_started) uring_recv(t);
+    return;
+  }
+  if (uc->closing) uring_finish(t);
+  else uring_close(t,NULL);
+}
+
+void uring_resume(struct client_thread *t) {
+  struct uring_conn *uc=t->uring;
+  if (uc->closing) return;
+  if (flood_resume(t)) {
+    uring_close(t,NULL);
+    return;
+  }
+  if (t->held) flood_wait(t);
+  else if (!uc->recv_armed) uring_recv(t);
+  uring_flush(t);
+}
+
+// start receiving on a connection new to this worker
+void uring_add(struct client_thread *t) {
+  t->uring=calloc(sizeof(struct uring_conn),1);
+  if (!t->uring) {
+    close(t->fd);
+    connection_closed();
+    reactor_release(t);
+    return;
+  }
+  if (!t->held&&!handover_started) uring_recv(t);
+  uring_flush(t);
+}
+
+void uring_accepted(struct reactor *r,int client_sock) {
+  // without reuseport this is the one listening socket, so share the
+  // connections out
+  if (!reuseport) { reactor_dispatch(client_sock); return; }
+  struct client_thread *t=reactor_client_new(r,client_sock);
+  if (t) reactor_add(r,t);
+}
+
+// acts on whatever has completed
+void uring_reap(struct reactor *r) {
+  struct uring *u=r->ring;
+  unsigned head=*u->cq_head;
+  unsigned tail=__atomic_load_n(u->cq_tail,__ATOMIC_ACQUIRE);
+  for(;head!=tail;head++) {
+    struct io_uring_cqe *cqe=&u->cqes[head&*u->cq_mask];
+    uint64_t user_data=cqe->user_data;
+    int res=cqe->res;
+    unsigned flags=cqe->flags;
+    // let the kernel have the slot back before we act on it, since
+    // acting on it may mean submitting more
+    __atomic_store_n(u->cq_head,head+1,__ATOMIC_RELEASE);
+    void *p=(void *)(uintptr_t)(user_data&~(uint64_t)URING_KIND);
+    switch(user_data&URING_KIND) {
+    case URING_ACCEPT:
+      if (res>=0) uring_accepted(r,res);
+      if (!(flags&IORING_CQE_F_MORE)) {
+        r->accepting=0;
+        if (!handover_started) uring_accept(r);
+      }
+      break;
+    case URING_WAKE:
+      reactor_wake(r);
+      if (!(flags&IORING_CQE_F_MORE)) uring_wake(r);
+      break;
+    case URING_RECV: uring_recv_done(p,res,flags); break;
+    case URING_SEND: uring_send_done(p,res); break;
+    }
+  }
+}
+
+// whether the kernel still has a receive, a send or the accept going for
+// anything of this worker's
+int uring_busy(struct reactor *r) {
+  if (r->accepting) return 1;
+  struct client_thread *t;
+  for(t=r->clients;t;t=t->next)
+    if (t->uring&&(t->uring->recv_armed||t->uring->sends)) return 1;
+  return 0;
+}
+
+// stops the accept and every receive for a handover, and waits for them to
+// end, and for sends under way to finish, before parking. a connection that
+// cannot finish sending within HANDOVER_DRAIN_MS is left behind.
+void uring_park(struct reactor *r) {
+  struct uring *u=r->ring;
+  if (r->accepting) {
+    struct io_uring_sqe *sqe=uring_sqe(u,1);
+    sqe->opcode=IORING_OP_ASYNC_CANCEL;
+    sqe->fd=-1;
+    sqe->addr=(uintptr_t)r|URING_ACCEPT;
+    sqe->user_data=URING_CANCEL;
+  }
+  struct client_thread *t;
+  for(t=r->clients;t;t=t->next)
+    if (t->uring) uring_recv_cancel(t);
+  long long until=clock_ns()+HANDOVER_DRAIN_MS*1000000LL;
+  while(uring_busy(r)&&clock_ns()<until) {
+    uring_enter(u,10);
+    uring_reap(r);
+  }
+  handover_park();
+}
+
+void *uring_loop(void *data) {
+  struct reactor *r=data;
+  r->ring=uring_new();
+  if (!r->ring) {
+    perror("Could not set up io_uring");
+    exit(-1);
+  }
+  struct uring *u=r->ring;
+  uring_wake(r);
+  if (r->listen_fd!=-1) uring_accept(r);
+
+  while(1) {
+    if (__atomic_load_n(&handover_started,__ATOMIC_ACQUIRE)) uring_park(r);
+    // with no timers to run there is nothing to do until something happens
+    if (uring_enter(u,flood_timeout(r,r->timers.count?REACTOR_TICK_MS:-1))==-1&&
+        errno!=EINTR&&errno!=ETIME&&errno!=EBUSY&&errno!=EAGAIN) {
+      perror("io_uring_enter() failed");
+      usleep(10000);
+    }
+    uring_reap(r);
+    flood_run(r);
+
+    // close whichever connections have been idle too long
+    timer_advance(&r->timers,timer_clock());
+  }
+  return NULL;
+}
+
+int listen_socket_take(int port,int reuse_port);
+
+int reactor_start(int count,int port) {
+  reactors=calloc(sizeof(struct reactor),count);
+  if (!reactors) return -1;
+  reactor_count=count;
+  int i;
+  // every worker must be ready to be handed connections before any starts
+  for(i=0;i<count;i++) {
+    struct reactor *r=&reactors[i];
+    r->id=i;
+    pthread_mutex_init(&r->pending_lock,NULL);
+    r->wakefd=eventfd(0,EFD_NONBLOCK);
+    timer_wheel_init(&r->timers);
+    if (r->wakefd==-1) return -1;
+    r->listen_fd=-1;
+    if (server_mode==MODE_URING) {
+      // the ring is set up by the worker itself. the first worker accepts
+      // on the shared socket unless they all have their own.
+      if (reuseport||i==0) r->listen_fd=listen_socket_take(port,reuseport);
+      if (r->listen_fd==-1&&(reuseport||i==0)) return -1;
+      continue;
+    }
+    r->epfd=epoll_create1(0);
+    if (r->epfd==-1) return -1;
+    struct epoll_event ev;
+    ev.events=EPOLLIN;
+    ev.data.ptr=NULL;
+    if (epoll_ctl(r->epfd,EPOLL_CTL_ADD,r->wakefd,&ev)==-1) return -1;
+    if (reuseport) {
+      // level-triggered, so a backlog bigger than one batch is not forgotten
+      r->listen_fd=listen_socket_take(port,1);
+      if (r->listen_fd==-1) return -1;
+      ev.events=EPOLLIN;
+      ev.data.ptr=r;
+      if (epoll_ctl(r->epfd,EPOLL_CTL_ADD,r->listen_fd,&ev)==-1) return -1;
+    }
+  }
+  for(i=0;i<count;i++)
+    if (pthread_create(&reactors[i].thread,NULL,server_mode==MODE_URING?uring_loop:reactor_loop,&reactors[i]))
+      return -1;
+  return 0;
+}
+
+// the worker to give the next connection to, in turn
+struct reactor *reactor_next(void) {
+  static unsigned int next_reactor=0;
+  return &reactors[__atomic_fetch_add(&next_reactor,1,__ATOMIC_RELAXED)%reactor_count];
+}
+
+// passes a new connection to a worker, which starts servicing it
+void reactor_hand_over(struct reactor *r,struct client_thread *t) {
+  t->reactor=r;
+  pthread_mutex_lock(&r->pending_lock);
+  t->next=r->pending;
+  r->pending=t;
+  pthread_mutex_unlock(&r->pending_lock);
+
+  uint64_t v=1;
+  write(r->wakefd,&v,sizeof(v));
+}
+
+// hand a freshly accepted non-blocking socket to the next worker in turn
+int reactor_dispatch(int client_sock) {
+  struct reactor *r=reactor_next();
+  struct client_thread *t=reactor_client_new(r,client_sock);
+  if (!t) return -1;
+  reactor_hand_over(r,t);
+  return 0;
+}
+
+// connects to -L peer number peer, given as host:port, and queues our
+// SERVER for it. returns -1 if it cannot be reached.
+int link_connect(int peer) {
+  char host[256];
+  snprintf(host,256,"%s",link_peers[peer]);
+  char *port=strrchr(host,':');
+  if (!port) return -1;
+  *port++=0;
+  struct addrinfo hints,*ai;
+  memset(&hints,0,sizeof(hints));
+  hints.ai_family=AF_UNSPEC;
+  hints.ai_socktype=SOCK_STREAM;
+  if (getaddrinfo(host,port,&hints,&ai)) return -1;
+  int sock=socket(ai->ai_family,SOCK_STREAM,0);
+  if (sock!=-1&&connect(sock,ai->ai_addr,ai->ai_addrlen)) {
+    close(sock);
+    sock=-1;
+  }
+  freeaddrinfo(ai);
+  if (sock==-1) return -1;
+  if (connection_admit()) {
+    close(sock);
+    return -1;
+  }
+  struct client_thread *t=client_new(sock);
+  if (!t) {
+    close(sock);
+    connection_closed();
+    return -1;
+  }
+  t->linking=1;
+  t->link_peer=peer+1;
+  output_printf(t,"PASS %s\nSERVER %s 1 :%s\n",link_password,server_name,server_name);
+  __atomic_store_n(&link_peer_up[peer],1,__ATOMIC_RELAXED);
+  if (server_mode!=MODE_THREADS) {
+    fcntl(sock,F_SETFL,fcntl(sock,F_GETFL,NULL)|O_NONBLOCK);
+    client_socket_options(sock);
+    reactor_hand_over(reactor_next(),t);
+    return 0;
+  }
+  pthread_t thread;
+  if (pthread_create(&thread,&connection_attr,handle_connection,t)) {
+    output_free(&t->output);
+    close(sock);
+    slab_free(t);
+    connection_closed();
+    link_peer_down(peer);
+    return -1;
+  }
+  return 0;
+}
+
+void link_peer_down(int peer) {
+  __atomic_store_n(&link_peer_up[peer],0,__ATOMIC_RELAXED);
+}
+
+// keeps trying to link to whichever -L peers we are not linked to. one we
+// can reach but that refuses us, because we are linked through someone
+// else already, is tried again in case that changes.
+void *link_thread(void *data) {
+  while(1) {
+    int i;
+    for(i=0;i<link_peer_count;i++)
+      if (!__atomic_load_n(&link_peer_up[i],__ATOMIC_RELAXED)) link_connect(i);
+    sleep(LINK_RETRY_S);
+  }
+  return NULL;
+}
+
+void links_start(void) {
+  if (!link_peer_count) return;
+  pthread_t thread;
+  if (pthread_create(&thread,NULL,link_thread,NULL)) {
+    perror("Could not start link thread");
+    exit(-1);
+  }
+}
+
+// hot restart. the successor connects to handover_path and is sent every
+// listening socket, and then every connection with what we know about it,
+// one message each with the descriptor passed as SCM_RIGHTS. links are not
+// handed over: their peers link to the successor by themselves.
+#define HANDOVER_LISTEN 1
+#define HANDOVER_CLIENT 2
+#define HANDOVER_OUTPUT 3
+#define HANDOVER_END 4
+// most output, or channel names, in one message
+#define HANDOVER_CHUNK (64*1024)
+#define HANDOVER_MESSAGE (LINE_SIZE+FLOOD_HELD_MAX+HANDOVER_CHUNK)
+
+// the start of every message. a connection's is followed by its partial
+// line, its held input and the channels it is on, separated by commas, and
+// then by HANDOVER_OUTPUT messages with the output it has not been sent.
+struct handover_record {
+  int kind;
+  int user_command_seen;
+  int user_has_registered;
+  char nickname[32];
+  int line_len;
+  int held_len;
+  int channels_len;
+};
+
+// what the server we replaced handed us, until it is used
+int *handover_listeners=NULL;
+int handover_listener_count=0;
+int handover_listener_next=0;
+struct client_thread *handover_clients=NULL;
+
+// the epoll mode acceptor, which has to be interrupted to park
+int handover_master=-1;
+pthread_t handover_acceptor;
+int handover_parked=0;
+
+// a listening socket that was handed over to us, or else a new one
+int listen_socket_take(int port,int reuse_port) {
+  if (handover_listener_next<handover_listener_count)
+    return handover_listeners[handover_listener_next++];
+  return create_listen_socket(port,reuse_port);
+}
+
+int handover_send(int sock,struct handover_record *h,int fd,char *data,int len) {
+  struct iovec iov[2];
+  iov[0].iov_base=h;
+  iov[0].iov_len=sizeof(struct handover_record);
+  iov[1].iov_base=data;
+  iov[1].iov_len=len;
+  union { struct cmsghdr header; char space[CMSG_SPACE(sizeof(int))]; } control;
+  struct msghdr msg;
+  memset(&msg,0,sizeof(msg));
+  msg.msg_iov=iov;
+  msg.msg_iovlen=len?2:1;
+  if (fd!=-1) {
+    msg.msg_control=control.space;
+    msg.msg_controllen=sizeof(control.space);
+    struct cmsghdr *c=CMSG_FIRSTHDR(&msg);
+    c->cmsg_level=SOL_SOCKET;
+    c->cmsg_type=SCM_RIGHTS;
+    c->cmsg_len=CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(c),&fd,sizeof(int));
+  }
+  while(sendmsg(sock,&msg,0)==-1)
+    if (errno!=EINTR) return -1;
+  return 0;
+}
+
+// returns the length of the message, or -1, with its descriptor if it
+// came with one in fd
+int handover_recv(int sock,char *buffer,int size,int *fd) {
+  struct iovec iov;
+  iov.iov_base=buffer;
+  iov.iov_len=size;
+  union { struct cmsghdr header; char space[CMSG_SPACE(sizeof(int))]; } control;
+  struct msghdr msg;
+  memset(&msg,0,sizeof(msg));
+  msg.msg_iov=&iov;
+  msg.msg_iovlen=1;
+  msg.msg_control=control.space;
+  msg.msg_controllen=sizeof(control.space);
+  ssize_t n;
+  while((n=recvmsg(sock,&msg,0))==-1&&errno==EINTR);
+  *fd=-1;
+  struct cmsghdr *c=n>0?CMSG_FIRSTHDR(&msg):NULL;
+  if (c&&c->cmsg_level==SOL_SOCKET&&c->cmsg_type==SCM_RIGHTS&&c->cmsg_len==CMSG_LEN(sizeof(int)))
+    memcpy(fd,CMSG_DATA(c),sizeof(int));
+  if (n<(ssize_t)sizeof(struct handover_record)||msg.msg_flags&(MSG_TRUNC|MSG_CTRUNC)) {
+    if (*fd!=-1) close(*fd);
+    *fd=-1;
+    return -1;
+  }
+  return n;
+}
+
+// sends a connection, and then the output it has not been sent, including
+// mail it has not looked at yet. buffer has room for HANDOVER_MESSAGE.
+int handover_client(int sock,struct client_thread *t,char *buffer) {
+  // links, and connections on their way out, stay behind
+  if (t->server||t->linking||t->timed_out||t->sendq_exceeded||t->killed) return 0;
+  if (t->uring&&(t->uring->closing||t->uring->sends)) return 0;
+
+  struct handover_record h;
+  memset(&h,0,sizeof(h));
+  h.kind=HANDOVER_CLIENT;
+  h.user_command_seen=t->user_command_seen;
+  h.user_has_registered=t->user_has_registered;
+  strcpy(h.nickname,t->nickname);
+  h.line_len=t->line_len;
+  h.held_len=t->held_len;
+  if (t->line_len) memcpy(buffer,t->line,t->line_len);
+  if (t->held_len) memcpy(&buffer[t->line_len],t->held,t->held_len);
+  char *channels=&buffer[t->line_len+t->held_len];
+  struct membership *m;
+  for(m=t->channels;m;m=m->next) {
+    int len=strlen(m->channel->name);
+    if (h.channels_len+len+1>HANDOVER_CHUNK) break;
+    if (h.channels_len) channels[h.channels_len++]=',';
+    memcpy(&channels[h.channels_len],m->channel->name,len);
+    h.channels_len+=len;
+  }
+  if (handover_send(sock,&h,t->fd,buffer,h.line_len+h.held_len+h.channels_len)) return -1;
+
+  inbox_collect(t);
+  h.kind=HANDOVER_OUTPUT;
+  struct output *o=&t->output;
+  int len=0,i;
+  for(i=0;i<o->count;i++) {
+    struct output_segment *s=&o->segments[i];
+    char *data=(s->shared?s->shared->data:o->buf)+s->offset;
+    int done=0;
+    while(done<s->len) {
+      int n=s->len-done<HANDOVER_CHUNK-len?s->len-done:HANDOVER_CHUNK-len;
+      memcpy(&buffer[len],&data[done],n);
+      len+=n;
+      done+=n;
+      if (len==HANDOVER_CHUNK) {
+        if (handover_send(sock,&h,-1,buffer,len)) return -1;
+        len=0;
       }
-      else usleep(10000);
     }
   }
+  if (len&&handover_send(sock,&h,-1,buffer,len)) return -1;
+  return 0;
+}
+
+// sends everything to the successor once every worker has parked. the
+// journal is closed before the successor is told that it has it all, so
+// that it can open it.
+void handover_send_all(int sock) {
+  int size=HANDOVER_MESSAGE*2;
+  setsockopt(sock,SOL_SOCKET,SO_SNDBUF,&size,sizeof(size));
+  char *buffer=malloc(HANDOVER_MESSAGE);
+  if (!buffer) {
+    perror("Could not hand over");
+    exit(-1);
+  }
+  struct handover_record h;
+  memset(&h,0,sizeof(h));
+  h.kind=HANDOVER_LISTEN;
+  if (handover_master!=-1) handover_send(sock,&h,handover_master,NULL,0);
+  int i;
+  for(i=0;i<reactor_count;i++)
+    if (reactors[i].listen_fd!=-1) handover_send(sock,&h,reactors[i].listen_fd,NULL,0);
+
+  // the workers have stopped, so this commits everything, and no mail is
+  // left waiting for the journal
+  if (journal_dir) journal_commit();
+  int count=0;
+  for(i=0;i<reactor_count;i++) {
+    struct reactor *r=&reactors[i];
+    struct client_thread *t;
+    pthread_mutex_lock(&r->pending_lock);
+    for(t=r->pending;t;t=t->next)
+      if (!handover_client(sock,t,buffer)) count++;
+    pthread_mutex_unlock(&r->pending_lock);
+    for(t=r->clients;t;t=t->next)
+      if (!handover_client(sock,t,buffer)) count++;
+  }
+  free(buffer);
+  fprintf(stderr,"Handing over %d connections\n",count);
+
+  if (journal_dir) journal_close();
+  h.kind=HANDOVER_END;
+  handover_send(sock,&h,-1,NULL,0);
+  // wait for the successor to have it all before our copies close
+  char ack;
+  while(read(sock,&ack,1)==-1&&errno==EINTR);
+}
+
+// a worker, or the acceptor, stops here for good once a handover has begun
+void handover_park(void) {
+  __atomic_add_fetch(&handover_parked,1,__ATOMIC_RELEASE);
+  while(1) pause();
+}
+
+// only there to interrupt the acceptor
+void handover_signal(int sig) {
+}
+
+void *handover_thread(void *data) {
+  int listener=(intptr_t)data;
+  int sock;
+  while((sock=accept(listener,NULL,NULL))==-1)
+    if (errno!=EINTR&&errno!=ECONNABORTED) usleep(10000);
+  close(listener);
+
+  // wake everyone until they have all parked
+  __atomic_store_n(&handover_started,1,__ATOMIC_RELEASE);
+  int expected=reactor_count+(handover_master!=-1);
+  while(__atomic_load_n(&handover_parked,__ATOMIC_ACQUIRE)<expected) {
+    int i;
+    for(i=0;i<reactor_count;i++) {
+      uint64_t v=1;
+      write(reactors[i].wakefd,&v,sizeof(v));
+    }
+    if (handover_master!=-1) pthread_kill(handover_acceptor,SIGUSR2);
+    usleep(10000);
+  }
+  handover_send_all(sock);
+  exit(0);
+}
+
+// a connection handed over to us, or NULL if it could not be taken
+struct client_thread *handover_restore(int fd,struct handover_record *h,char *data,int len) {
+  if (h->line_len<0||h->line_len>=LINE_SIZE||h->held_len<0||h->held_len>FLOOD_HELD_MAX||
+      h->channels_len<0||h->line_len+h->held_len+h->channels_len!=len||connection_admit()) {
+    close(fd);
+    return NULL;
+  }
+  struct client_thread *t=client_new(fd);
+  if (!t) {
+    close(fd);
+    connection_closed();
+    return NULL;
+  }
+  t->restored=1;
+  t->user_command_seen=h->user_command_seen;
+  t->user_has_registered=h->user_has_registered;
+  h->nickname[31]=0;
+  if (h->nickname[0]) nick_claim(t,h->nickname);
+  if (h->line_len&&(t->line=pool_alloc(LINE_SIZE))) {
+    memcpy(t->line,data,h->line_len);
+    t->line_len=h->line_len;
+    t->line[t->line_len]=0;
+  }
+  if (h->held_len) flood_hold(t,(unsigned char *)&data[h->line_len],h->held_len);
+  // there is room after the message to end the list
+  char *channels=&data[h->line_len+h->held_len];
+  channels[h->channels_len]=0;
+  char *save;
+  char *name=strtok_r(channels,",",&save);
+  while(name) {
+    channel_join(t,name,1);
+    name=strtok_r(NULL,",",&save);
+  }
+  return t;
+}
+
+// takes over from the server listening on handover_path, if there is one.
+// this has to happen before the journal is opened, which that server
+// closes once it has handed everything over.
+void handover_receive(void) {
+  struct sockaddr_un addr;
+  memset(&addr,0,sizeof(addr));
+  addr.sun_family=AF_UNIX;
+  snprintf(addr.sun_path,sizeof(addr.sun_path),"%s",handover_path);
+  int sock=socket(AF_UNIX,SOCK_SEQPACKET,0);
+  if (sock==-1) return;
+  if (connect(sock,(struct sockaddr *)&addr,sizeof(addr))) {
+    close(sock);
+    return;
+  }
+  int size=sizeof(struct handover_record)+HANDOVER_MESSAGE;
+  char *buffer=malloc(size+1);
+  if (!buffer) {
+    perror("Could not take over");
+    exit(-1);
+  }
+  struct handover_record *h=(struct handover_record *)buffer;
+  char *data=&buffer[sizeof(struct handover_record)];
+  struct client_thread *last=NULL;
+  int count=0,fd,n;
+  while((n=handover_recv(sock,buffer,size,&fd))!=-1) {
+    n-=sizeof(struct handover_record);
+    if (h->kind==HANDOVER_END) break;
+    if (h->kind==HANDOVER_OUTPUT) {
+      if (last) output_append(last,data,n);
+      continue;
+    }
+    if (fd==-1) continue;
+    if (h->kind==HANDOVER_LISTEN) {
+      int *l=realloc(handover_listeners,(handover_listener_count+1)*sizeof(int));
+      if (!l) { close(fd); continue; }
+      handover_listeners=l;
+      handover_listeners[handover_listener_count++]=fd;
+      continue;
+    }
+    if (h->kind!=HANDOVER_CLIENT) {
+      close(fd);
+      continue;
+    }
+    if (!(last=handover_restore(fd,h,data,n))) continue;
+    last->next=handover_clients;
+    handover_clients=last;
+    count++;
+  }
+  char ack=1;
+  write(sock,&ack,1);
+  close(sock);
+  free(buffer);
+  fprintf(stderr,"Took over %d listening sockets and %d connections\n",handover_listener_count,count);
+}
+
+// starts servicing the connections handed over to us, and listens for
+// the server that is to replace us in turn. master is the socket the
+// calling thread accepts on in epoll mode, otherwise -1.
+void handover_start(int master) {
+  // listening sockets that were not taken were for workers we do not have
+  while(handover_listener_next<handover_listener_count)
+    close(handover_listeners[handover_listener_next++]);
+  while(handover_clients) {
+    struct client_thread *t=handover_clients;
+    handover_clients=t->next;
+    reactor_hand_over(reactor_next(),t);
+  }
+  if (!handover_path) return;
+
+  handover_master=master;
+  handover_acceptor=pthread_self();
+  // without SA_RESTART, so that accept() is interrupted
+  struct sigaction sa;
+  memset(&sa,0,sizeof(sa));
+  sa.sa_handler=handover_signal;
+  sigaction(SIGUSR2,&sa,NULL);
+
+  struct sockaddr_un addr;
+  memset(&addr,0,sizeof(addr));
+  addr.sun_family=AF_UNIX;
+  snprintf(addr.sun_path,sizeof(addr.sun_path),"%s",handover_path);
+  unlink(handover_path);
+  int sock=socket(AF_UNIX,SOCK_SEQPACKET,0);
+  pthread_t thread;
+  if (sock==-1||bind(sock,(struct sockaddr *)&addr,sizeof(addr))||listen(sock,1)||
+      pthread_create(&thread,NULL,handover_thread,(void *)(intptr_t)sock)) {
+    perror("Could not listen for a handover");
+    exit(-1);
+  }
+}
+
+void stats_print(void *context,const char *line) {
+  fprintf(stderr,"%s\n",line);
+}
+
+// prints the statistics to stderr whenever we get SIGUSR1, which every
+// other thread has blocked
+void *stats_signal_thread(void *data) {
+  sigset_t *signals=data;
+  while(1) {
+    int sig;
+    if (sigwait(signals,&sig)) continue;
+    stats_report(stats_print,NULL);
+  }
+  return NULL;
+}
+
+void usage(void) {
+  fprintf(stderr,"usage: sample [-m threads|epoll|uring] [-t reactor threads] [-r] [-c max clients]\n"
+          "              [-l message log size] [-b listen backlog] [-i idle seconds]\n"
+          "              [-q sendq bytes] [-D] [-f lines per second] [-F bytes per second]\n"
+          "              [-T trace 1 in n] [-j journal directory] [-N server name] [-L host:port]...\n"
+          "              [-P link password] [-H handover socket] <tcp port>\n");
+  exit(-1);
+}
+
+int main(int argc,char **argv) {
+  signal(SIGPIPE, SIG_IGN);
+
+  int opt;
+  char *journal=NULL;
+  while((opt=getopt(argc,argv,"m:t:rc:l:b:i:q:Df:F:T:j:N:L:P:H:"))!=-1) {
+    switch(opt) {
+    case 'm':
+      if (!strcasecmp(optarg,"threads")) server_mode=MODE_THREADS;
+      else if (!strcasecmp(optarg,"epoll")) server_mode=MODE_EPOLL;
+      else if (!strcasecmp(optarg,"uring")) server_mode=MODE_URING;
+      else usage();
+      break;
+    case 't': reactor_count=atoi(optarg); break;
+    case 'c': max_clients=atoi(optarg); break;
+    case 'l': message_log_size=atoi(optarg); break;
+    case 'r': reuseport=1; break;
+    case 'b': listen_backlog=atoi(optarg); break;
+    case 'i': idle_timeout=atoi(optarg); break;
+    case 'q': sendq_limit=atoll(optarg); break;
+    case 'D': sendq_drop=1; break;
+    case 'f': flood_lines=atoi(optarg); break;
+    case 'F': flood_bytes=atoi(optarg); break;
+    case 'T': trace_rate=atoi(optarg); break;
+    case 'j': journal=optarg; break;
+    case 'N': server_name=optarg; break;
+    case 'L':
+      if (link_peer_count>=MAX_LINK_PEERS) usage();
+      link_peers[link_peer_count++]=optarg;
+      break;
+    case 'P': link_password=optarg; break;
+    case 'H': handover_path=optarg; break;
+    default: usage();
+    }
+  }
+  if (optind!=argc-1||message_log_size<1||listen_backlog<1||idle_timeout<1||sendq_limit<1||max_clients<1||
+      flood_lines<0||flood_bytes<0||trace_rate<0||
+      strlen(server_name)>=64||strchr(server_name,' ')) usage();
+  if ((reuseport||handover_path)&&server_mode==MODE_THREADS) usage();
+  if (link_peer_count&&!link_password) usage();
+  if (handover_path&&strlen(handover_path)>=sizeof(((struct sockaddr_un *)0)->sun_path)) usage();
+  if (server_mode==MODE_URING&&!uring_available()) {
+    fprintf(stderr,"io_uring is not available (%s), using epoll instead\n",strerror(errno));
+    server_mode=MODE_EPOLL;
+  }
+  nick_table_init();
+  command_table_init();
+  stats_init();
+  pool_init();
+  connection_attr_init();
+
+  // threads started from here on inherit the blocked signal
+  static sigset_t stats_signals;
+  sigemptyset(&stats_signals);
+  sigaddset(&stats_signals,SIGUSR1);
+  pthread_sigmask(SIG_BLOCK,&stats_signals,NULL);
+  pthread_t stats_thread;
+  if (pthread_create(&stats_thread,NULL,stats_signal_thread,&stats_signals)) {
+    perror("Could not start statistics thread");
+    exit(-1);
+  }
+  
+  int port=atoi(argv[optind]);
+
+  if (server_mode!=MODE_THREADS) {
+    if (reactor_count<1) reactor_count=sysconf(_SC_NPROCESSORS_ONLN);
+    if (reactor_count<1) reactor_count=1;
+  }
+  connection_limit_init();
+  if (handover_path) handover_receive();
+
+  if (message_log_init(message_log_size)) {
+    perror("Could not allocate message log");
+    exit(-1);
+  }
+  if (journal&&journal_open(journal)) {
+    perror("Could not open journal");
+    exit(-1);
+  }
+
+  // the workers accept for themselves, except in epoll mode without
+  // reuseport, where this thread does
+  int master_socket=-1;
+  if (server_mode==MODE_THREADS||(server_mode==MODE_EPOLL&&!reuseport)) {
+    master_socket=listen_socket_take(port,0);
+    fcntl(master_socket,F_SETFL,fcntl(master_socket, F_GETFL, NULL)&(~O_NONBLOCK));  
+  }
+
+  if (server_mode!=MODE_THREADS) {
+    if (reactor_start(reactor_count,port)) {
+      perror("Could not start reactor threads");
+      exit(-1);
+    }
+    handover_start(master_socket);
+    links_start();
+    if (master_socket==-1) pthread_join(reactors[0].thread,NULL);
+    while(1) {
+      if (__atomic_load_n(&handover_started,__ATOMIC_ACQUIRE)) handover_park();
+      stat_syscall();
+      int client_sock = accept4(master_socket,NULL,NULL,SOCK_NONBLOCK);
+      if (client_sock!=-1) reactor_dispatch(client_sock);
+      else if (errno==EMFILE||errno==ENFILE) usleep(10000);
+    }
+  }
+
+  timer_wheel_init(&client_timers);
+  pthread_t timer_thread;
+  if (pthread_create(&timer_thread,NULL,client_timer_thread,NULL)) {
+    perror("Could not start timer thread");
+    exit(-1);
+  }
+  links_start();
+
+  // allocates memory for an array of structs
+  // creates thread for the handle connection function
+  while(1) {
+    int client_sock = accept_incoming(master_socket);
+    if (client_sock==-1) {
+      // out of file descriptors: give some a chance to close
+      if (errno==EMFILE||errno==ENFILE) usleep(10000);
+      continue;
+    }
+    // turn away what we have no room for before allocating anything
+    if (connection_admit()) {
+      connection_reject(client_sock);
+      continue;
+    }
+    struct client_thread *t=client_new(client_sock);
+    if(t!=NULL){
+      // the thread frees t when it is done, so keep its id elsewhere
+      pthread_t thread;
+      int err = pthread_create(&thread,&connection_attr,handle_connection,(void*)t);
+      if (err) { close(client_sock); slab_free(t); connection_closed(); }
+    }
+    else { close(client_sock); connection_closed(); usleep(10000); }
+  }
 }
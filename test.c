@@ -20,6 +20,7 @@
 
 */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -36,8 +37,12 @@
 #include <netdb.h>
 #include <time.h>
 #include <errno.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
 
-#define TOTAL_TESTS 59
+#define TOTAL_TESTS 109
 
 pid_t student_pid=-1;
 int student_port;
@@ -139,7 +144,10 @@ int read_from_socket(int sock,unsigned char *buffer,int *count,int buffer_size,
     if (r==-1&&errno!=EAGAIN) {
       perror("read() returned error. Stopping reading from socket.");
       return -1;
-    } else usleep(100000);
+    }
+    // what we just read is counted at the top of the loop
+    if (r>0) continue;
+    usleep(100000);
     // timeout after a few seconds of nothing
     if (time(0)>=t) break;
   }
@@ -147,41 +155,68 @@ int read_from_socket(int sock,unsigned char *buffer,int *count,int buffer_size,
   return 0;
 }
 
-int launch_student_programme(const char *executable)
+// starts another copy of the server listening on port, with extra_args
+// and then more_args before the port number. returns its pid, or -1.
+pid_t launch_server(const char *executable,char **extra_args,char **more_args,
+		    int port)
 {
-  // Find a free TCP port for the student programme to listen on
-  // that is not currently in use.
-  student_port=(getpid()|0x8000)&0xffff;
-  int portclear=0;
-  while(!portclear&&(student_port<65536)) {
-    int sock=connect_to_port(student_port);
-    if (sock==-1) portclear=1; 
-    else close(sock);
-  }
-  fprintf(stderr,"Port %d is available for use by student programme.\n",
-	  student_port);
-
   pid_t child_pid = fork();
 
   if (child_pid==-1) {
     perror("fork"); return -1;
   }
-  char port[128];
-  snprintf(port,128,"%d",student_port);
-  const char *const args[]={executable,port,NULL,NULL};
+  char portname[128];
+  snprintf(portname,128,"%d",port);
+  // any extra arguments (e.g. -m epoll) go before the port number
+  const char *args[64];
+  int n=0;
+  args[n++]=executable;
+  while(extra_args&&*extra_args&&n<46) args[n++]=*extra_args++;
+  while(more_args&&*more_args&&n<62) args[n++]=*more_args++;
+  args[n++]=portname;
+  args[n]=NULL;
 
   if (!child_pid) {
     // as the child: so exec() to the student's program
     execv(executable,(char **)args);
     /* execv doesn't return if it is successful */
     perror("execv");
-    return -1;
+    exit(-1);
   }
+  return child_pid;
+}
+
+// finds a TCP port at or after port that nothing is listening on
+int free_port(int port)
+{
+  while(port<65536) {
+    int sock=connect_to_port(port);
+    if (sock==-1) return port;
+    close(sock);
+    port++;
+  }
+  return -1;
+}
+
+const char *student_executable;
+char **student_args;
+
+int launch_student_programme(const char *executable,char **extra_args)
+{
+  // Find a free TCP port for the student programme to listen on
+  // that is not currently in use.
+  student_port=free_port((getpid()|0x8000)&0xffff);
+  fprintf(stderr,"Port %d is available for use by student programme.\n",
+	  student_port);
+
   /*
-    parent: just remember the PID so that we can kill it later
+    remember the PID so that we can kill it later, and how it was started
+    so that tests can start more of their own
   */
-  student_pid=child_pid;
-  return 0;
+  student_pid=launch_server(executable,extra_args,NULL,student_port);
+  student_executable=executable;
+  student_args=extra_args;
+  return student_pid==-1?-1:0;
 }
 
 int test_listensonport()
@@ -618,11 +653,9 @@ int test_registration()
 
 }
 
-int new_connection(char *nick)
+int new_connection_on(int port,char *nick)
 {
-  /* Test that student programme accepts 1,000 successive connections.
-     Further test that it can do so within a minute. */
-  int sock=connect_to_port(student_port);
+  int sock=connect_to_port(port);
   if (sock==-1) return -1;
   
   char buffer[8192];
@@ -674,6 +707,11 @@ int new_connection(char *nick)
   return sock;
 }
 
+int new_connection(char *nick)
+{
+  return new_connection_on(student_port,nick);
+}
+
 int test_multipleclients()
 {
   int i;
@@ -738,6 +776,29 @@ int test_multipleclients()
       }
     }
 
+  // One PRIVMSG to a list of nicknames: each recipient is sent it with
+  // their own nickname as the target, and unknown ones are refused
+  {
+    int a=(delta%9)+1,b=((delta+4)%9)+1;
+    char *greeting=greetings[random()&7];
+    sprintf(cmd,"PRIVMSG user%d,USER%d,user%d,nobodyhasthis :%s\n\r",a,b,a,greeting);
+    write(socks[0],cmd,strlen(cmd));
+    bytes=0;
+    read_from_socket(socks[a],(unsigned char *)buffer,&bytes,sizeof(buffer),2);
+    snprintf(nick,1024,"user%d",a);
+    test_next_response_is("PRIVMSG",nick,buffer,&bytes,"PRIVMSG to a list of users",
+			  greeting,0);
+    bytes=0;
+    read_from_socket(socks[b],(unsigned char *)buffer,&bytes,sizeof(buffer),2);
+    snprintf(nick,1024,"user%d",b);
+    test_next_response_is("PRIVMSG",nick,buffer,&bytes,"PRIVMSG to a list of users",
+			  greeting,0);
+    bytes=0;
+    read_from_socket(socks[0],(unsigned char *)buffer,&bytes,sizeof(buffer),2);
+    test_next_response_is("401","user0",buffer,&bytes,
+			  "PRIVMSG to a list with an unknown nick",NULL,0);
+  }
+
   // clean up after ourselves
   for(i=0;i<10;i++) {
     write(socks[i],"QUIT\r\n",6); close(socks[i]);
@@ -765,15 +826,1047 @@ int test_multipleclients()
   return 0;
 }
 
+int test_nicknames()
+{
+  /* Test that a nickname can only be held by one client at a time, using
+     the RFC 2812 casemapping, and that messages to a nickname nobody holds
+     are refused. */
+  int sock=new_connection("nick{holder}");
+  if (sock<0) {
+    printf("FAIL: Could not create registered connection\n");
+    return -1;
+  }
+
+  char buffer[8192];
+  int bytes=0;
+  int r;
+  char cmd[1024];
+
+  int sock2=connect_to_port(student_port);
+  if (sock2==-1) {
+    printf("FAIL: Could not connect to server\n");
+    write(sock,"QUIT\r\n",6); close(sock);
+    return -1;
+  }
+  r=read_from_socket(sock2,(unsigned char *)buffer,&bytes,sizeof(buffer),2);
+  if (r||(bytes<1)) {
+    printf("FAIL: No greeting received from server.\n");
+    close(sock2);
+    write(sock,"QUIT\r\n",6); close(sock);
+    return -1;
+  }
+  test_next_response_is("020","*",buffer,&bytes,"initial connection",NULL,1);
+
+  // [ and { are the same letter, so this nick is already taken
+  sprintf(cmd,"NICK NICK[HOLDER]\n\r");
+  write(sock2,cmd,strlen(cmd));
+  bytes=0;
+  r=read_from_socket(sock2,(unsigned char *)buffer,&bytes,sizeof(buffer),2);
+  if (r) printf("FAIL: Could not read the reply to NICK\n");
+  else test_next_response_is("433","*",buffer,&bytes,"NICK already in use",NULL,0);
+
+  // an empty nickname is refused rather than taken
+  write(sock2,"NICK :\n\r",8);
+  bytes=0;
+  r=read_from_socket(sock2,(unsigned char *)buffer,&bytes,sizeof(buffer),2);
+  if (r) printf("FAIL: Could not read the reply to an empty NICK\n");
+  else test_next_response_is("431","*",buffer,&bytes,"empty NICK",NULL,0);
+  write(sock2,"QUIT\r\n",6); close(sock2);
+
+  sprintf(cmd,"PRIVMSG nobodyhasthis :%s\n\r",greetings[random()&7]);
+  write(sock,cmd,strlen(cmd));
+  bytes=0;
+  r=read_from_socket(sock,(unsigned char *)buffer,&bytes,sizeof(buffer),2);
+  if (r) printf("FAIL: Could not read the reply to PRIVMSG\n");
+  else test_next_response_is("401","nick{holder}",buffer,&bytes,
+			     "PRIVMSG to unknown nick",NULL,0);
+  write(sock,"QUIT\r\n",6); close(sock);
+
+  return 0;
+}
+
+int read_until(int sock,char *buffer,int *bytes,int buffer_size,char *marker)
+{
+  // replies may arrive in several pieces, so keep reading for a little
+  // while until we see the one we want
+  int tries;
+  for(tries=0;tries<3;tries++) {
+    read_from_socket(sock,(unsigned char *)buffer,bytes,buffer_size-1,1);
+    buffer[*bytes]=0;
+    if (strstr(buffer,marker)) return 0;
+  }
+  return -1;
+}
+
+int test_channels()
+{
+  /* Test that clients can join a channel, that the members are told about
+     each other, and that a message to the channel reaches the other members
+     but not the sender. */
+  char *channel=channel_names[getpid()&3];
+  int sock1=new_connection("chanuser1");
+  int sock2=new_connection("chanuser2");
+  if (sock1<0||sock2<0) {
+    printf("FAIL: Could not create 2 registered connections\n");
+    if (sock1>-1) { write(sock1,"QUIT\r\n",6); close(sock1); }
+    if (sock2>-1) { write(sock2,"QUIT\r\n",6); close(sock2); }
+    return -1;
+  }
+
+  char buffer[8192];
+  int bytes;
+  char cmd[1024];
+
+  sprintf(cmd,"JOIN %s\n\r",channel);
+  write(sock1,cmd,strlen(cmd));
+  bytes=0;
+  failif(read_until(sock1,buffer,&bytes,sizeof(buffer)," 366 "),
+	 "No end of NAMES list after JOIN",
+	 "Server sent end of NAMES list after JOIN");
+
+  write(sock2,cmd,strlen(cmd));
+  bytes=0;
+  read_until(sock2,buffer,&bytes,sizeof(buffer)," 366 ");
+  failif(!strstr(buffer,"chanuser1"),
+	 "NAMES list after JOIN does not include existing member",
+	 "NAMES list after JOIN includes existing member");
+  bytes=0;
+  read_until(sock1,buffer,&bytes,sizeof(buffer),"JOIN");
+  failif(!strstr(buffer,"chanuser2!"),
+	 "Channel member was not told about a new member joining",
+	 "Channel member was told about a new member joining");
+
+  char *greeting=greetings[random()&7];
+  sprintf(cmd,"PRIVMSG %s :%s\n\r",channel,greeting);
+  write(sock1,cmd,strlen(cmd));
+  bytes=0;
+  read_from_socket(sock2,(unsigned char *)buffer,&bytes,sizeof(buffer),2);
+  test_next_response_is("PRIVMSG",channel,buffer,&bytes,"PRIVMSG to channel",
+			greeting,0);
+  bytes=0;
+  read_from_socket(sock1,(unsigned char *)buffer,&bytes,sizeof(buffer),1);
+  failif(bytes>0,
+	 "Sender received its own channel message",
+	 "Sender did not receive its own channel message");
+
+  write(sock1,"NICK chanuser3\n\r",16);
+  sprintf(cmd,"NAMES %s\n\r",channel);
+  // give the NICK time to land before asking
+  usleep(200000);
+  write(sock2,cmd,strlen(cmd));
+  bytes=0;
+  read_until(sock2,buffer,&bytes,sizeof(buffer)," 366 ");
+  failif(!strstr(buffer,"chanuser3")||strstr(buffer,"chanuser1"),
+	 "NAMES list does not follow a member's change of nickname",
+	 "NAMES list follows a member's change of nickname");
+
+  write(sock1,"QUIT\r\n",6); close(sock1);
+  write(sock2,"QUIT\r\n",6); close(sock2);
+  return 0;
+}
+
+int test_stats()
+{
+  /* Test that STATS reports the server's counters, and that they have seen
+     the messages sent by the earlier tests. */
+  int sock=new_connection("statsuser");
+  if (sock<0) {
+    printf("FAIL: Could not create a registered connection\n");
+    return -1;
+  }
+
+  char buffer[8192];
+  int bytes=0;
+  write(sock,"STATS m\n\r",9);
+  failif(read_until(sock,buffer,&bytes,sizeof(buffer)," 219 "),
+	 "No end of STATS report",
+	 "Server sent end of STATS report");
+  long long delivered=0;
+  char *counts=strstr(buffer,"delivered ");
+  if (counts) delivered=atoll(counts+10);
+  failif(delivered<1,
+	 "STATS report does not count delivered messages",
+	 "STATS report counts delivered messages");
+  write(sock,"QUIT\r\n",6); close(sock);
+  return 0;
+}
+
+// starts a server of our own on a free port, with more_args after the
+// options we were given, and waits until it takes connections. the port
+// is after *port if that is set. returns its pid, or -1.
+pid_t launch_test_server(char **more_args,int *port)
+{
+  *port=free_port(*port?*port+1:student_port+10);
+  pid_t pid=launch_server(student_executable,student_args,more_args,*port);
+  if (pid==-1) return -1;
+  int i,sock;
+  for(i=0;i<30;i++) {
+    usleep(100000);
+    if ((sock=connect_to_port(*port))>-1) { close(sock); return pid; }
+  }
+  kill(pid,SIGKILL);
+  waitpid(pid,NULL,0);
+  return -1;
+}
+
+void stop_test_server(pid_t pid)
+{
+  if (pid<=0) return;
+  kill(pid,SIGKILL);
+  waitpid(pid,NULL,0);
+}
+
+// sends STATS on sock and leaves the report in buffer
+int stats_report(int sock,char *buffer,int buffer_size)
+{
+  int bytes=0;
+  buffer[0]=0;
+  write(sock,"STATS\n\r",7);
+  return read_until(sock,buffer,&bytes,buffer_size," 219 ");
+}
+
+// registers nick on port without waiting to see that nothing else comes,
+// for tests that need many clients, or need them quickly. returns the
+// socket, or -1.
+int register_on(int port,char *nick)
+{
+  int sock=connect_to_port(port);
+  if (sock==-1) return -1;
+  char buffer[8192],cmd[1024];
+  int bytes=0;
+  snprintf(cmd,1024,"NICK %s\n\rUSER %s\n\r",nick,nick);
+  write(sock,cmd,strlen(cmd));
+  if (read_until(sock,buffer,&bytes,sizeof(buffer)," 255 ")) {
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+#define IDLE_CLIENTS 6
+
+int test_idle()
+{
+  /* Test that with -i a registered client that goes quiet is sent a PING
+     once its idle timeout has passed, and is disconnected when it stays
+     quiet a timeout longer, while a client that keeps sending stays.
+     Some of the quiet clients leave straight away, so the idle timers of
+     the others have timers taken out from around them. */
+  if (!student_executable) {
+    printf("PROGRESS: Not testing idle timeouts, as the server was already running\n");
+    return -1;
+  }
+  char *args[]={"-i","2",NULL};
+  int port=student_port+70;
+  pid_t pid=launch_test_server(args,&port);
+  int socks[IDLE_CLIENTS],i;
+  long long ping_us[IDLE_CLIENTS],closed_us[IDLE_CLIENTS];
+  char nick[32];
+  for(i=0;i<IDLE_CLIENTS;i++) {
+    snprintf(nick,32,"idleuser%d",i);
+    socks[i]=pid>0?register_on(port,nick):-1;
+    ping_us[i]=closed_us[i]=0;
+  }
+  int active=pid>0?register_on(port,"idleactive"):-1;
+  // every other quiet client leaves, and the rest are watched
+  for(i=1;i<IDLE_CLIENTS;i+=2)
+    if (socks[i]>-1) { write(socks[i],"QUIT\r\n",6); close(socks[i]); socks[i]=-1; }
+  struct timeval start,now;
+  gettimeofday(&start,NULL);
+  int step,open=0;
+  for(step=0;step<100;step++) {
+    if (step%5==0&&active>-1) write(active,"PONG :still here\n\r",18);
+    usleep(100000);
+    gettimeofday(&now,NULL);
+    long long us=(now.tv_sec-start.tv_sec)*1000000LL+now.tv_usec-start.tv_usec;
+    open=0;
+    for(i=0;i<IDLE_CLIENTS;i+=2) {
+      if (socks[i]<0||closed_us[i]) continue;
+      char buffer[8192];
+      fcntl(socks[i],F_SETFL,fcntl(socks[i],F_GETFL,NULL)|O_NONBLOCK);
+      int r=read(socks[i],buffer,sizeof(buffer)-1);
+      if (r>0) buffer[r]=0;
+      if (r>0&&strstr(buffer,"PING")&&!ping_us[i]) ping_us[i]=us;
+      if (r==0||(r==-1&&errno!=EAGAIN)||(r>0&&strstr(buffer,"Closing Link"))) closed_us[i]=us;
+      else open++;
+    }
+    if (!open) break;
+  }
+  int pinged=0,dropped=0,watched=0;
+  for(i=0;i<IDLE_CLIENTS;i+=2) {
+    if (socks[i]<0) continue;
+    watched++;
+    if (ping_us[i]>=1000000&&ping_us[i]<=4500000) pinged++;
+    if (ping_us[i]&&closed_us[i]>=ping_us[i]+1000000&&closed_us[i]<=ping_us[i]+3500000) dropped++;
+    close(socks[i]);
+  }
+  failif(!watched||pinged<watched,
+	 "A quiet client was not sent a PING once its idle timeout passed",
+	 "Quiet clients were sent a PING once their idle timeout passed");
+  failif(!watched||dropped<watched,
+	 "A quiet client was not disconnected a timeout after its PING",
+	 "Quiet clients were disconnected a timeout after their PING");
+  char buffer[8192];
+  int bytes=0;
+  if (active>-1) write(active,"NAMES #idle\n\r",13);
+  failif(active<0||read_until(active,buffer,&bytes,sizeof(buffer)," 366 "),
+	 "A client that kept sending was disconnected as idle",
+	 "A client that kept sending was not disconnected as idle");
+  if (active>-1) close(active);
+  stop_test_server(pid);
+  return 0;
+}
+
+#define REUSEPORT_CLIENTS 32
+
+int test_reuseport()
+{
+  /* Test that with -r, where every reactor worker accepts connections of
+     its own, clients spread over the workers all register and can send
+     each other private messages. */
+  if (!student_executable) {
+    printf("PROGRESS: Not testing a listener per worker, as the server was already running\n");
+    return -1;
+  }
+  char *args[]={"-m","epoll","-t","4","-r",NULL};
+  int port=student_port+80;
+  pid_t pid=launch_test_server(args,&port);
+  int socks[REUSEPORT_CLIENTS],i,registered=0,delivered=0;
+  char nick[32],cmd[128];
+  for(i=0;i<REUSEPORT_CLIENTS;i++) {
+    snprintf(nick,32,"reuseuser%d",i);
+    socks[i]=pid>0?register_on(port,nick):-1;
+    if (socks[i]>-1) registered++;
+  }
+  failif(registered<REUSEPORT_CLIENTS,
+	 "Not every client registered on a server with a listener per worker",
+	 "Every client registered on a server with a listener per worker");
+  // each sends to the next, who is most likely on another worker
+  for(i=0;i<REUSEPORT_CLIENTS;i++) {
+    if (socks[i]<0) continue;
+    snprintf(cmd,128,"PRIVMSG reuseuser%d :from reuseuser%d\n\r",(i+1)%REUSEPORT_CLIENTS,i);
+    write(socks[i],cmd,strlen(cmd));
+  }
+  for(i=0;i<REUSEPORT_CLIENTS;i++) {
+    if (socks[i]<0) continue;
+    char buffer[8192],expected[64];
+    int bytes=0;
+    snprintf(expected,64,":from reuseuser%d\n",(i+REUSEPORT_CLIENTS-1)%REUSEPORT_CLIENTS);
+    if (!read_until(socks[i],buffer,&bytes,sizeof(buffer),expected)) delivered++;
+  }
+  failif(delivered<REUSEPORT_CLIENTS,
+	 "Private messages between clients on different workers were lost",
+	 "Private messages between clients on different workers were delivered");
+  for(i=0;i<REUSEPORT_CLIENTS;i++) if (socks[i]>-1) close(socks[i]);
+  stop_test_server(pid);
+  return 0;
+}
+
+// the number STATS reports after label, or -1
+long long stats_count(int sock,char *label)
+{
+  char buffer[8192];
+  if (stats_report(sock,buffer,sizeof(buffer))) return -1;
+  char *p=strstr(buffer,label);
+  return p?atoll(p+strlen(label)):-1;
+}
+
+#define SLAB_CLIENTS 400
+
+int test_slabs()
+{
+  /* Test that the slab chunks connections are carved from go back to the
+     system once the clients have gone, whichever thread freed them, and
+     that a second lot of clients takes no more than the first. */
+  if (!student_executable) {
+    printf("PROGRESS: Not testing slab chunks, as the server was already running\n");
+    return -1;
+  }
+  char *args[]={NULL};
+  int port=student_port+90;
+  pid_t pid=launch_test_server(args,&port);
+  int watch=pid>0?register_on(port,"slabwatch"):-1;
+  char *label="slab chunks mapped for connections ";
+  long long before=watch>-1?stats_count(watch,label):-1;
+  long long peak[2]={-1,-1},after[2]={-1,-1};
+  int round,i,socks[SLAB_CLIENTS];
+  for(round=0;round<2&&before>0;round++) {
+    for(i=0;i<SLAB_CLIENTS;i++) socks[i]=connect_to_port(port);
+    for(i=0;i<30&&stats_count(watch,"connections ")<=SLAB_CLIENTS;i++) usleep(100000);
+    peak[round]=stats_count(watch,label);
+    for(i=0;i<SLAB_CLIENTS;i++) if (socks[i]>-1) close(socks[i]);
+    for(i=0;i<30&&stats_count(watch,"connections ")>1;i++) usleep(100000);
+    after[round]=stats_count(watch,label);
+  }
+  failif(peak[0]<before+2,
+	 "STATS did not count the slab chunks taken for new connections",
+	 "STATS counted the slab chunks taken for new connections");
+  // one chunk is kept spare
+  failif(after[0]<0||after[0]>before+1||after[1]<0||after[1]>before+1,
+	 "Slab chunks were not given back once the clients had gone",
+	 "Slab chunks were given back once the clients had gone");
+  failif(peak[1]<0||peak[1]>peak[0],
+	 "A second lot of clients took more slab chunks than the first",
+	 "A second lot of clients took no more slab chunks than the first");
+  if (watch>-1) close(watch);
+  stop_test_server(pid);
+  return 0;
+}
+
+int test_admission()
+{
+  /* Test that a server whose open file limit is lowered while it runs
+     turns away the clients it has no room for, keeps those it has, and
+     takes new ones again once some have gone. */
+  if (!student_executable) {
+    printf("PROGRESS: Not testing admission control, as the server was already running\n");
+    return -1;
+  }
+  char *args[]={"-t","2",NULL};
+  int port=student_port+50;
+  pid_t pid=launch_test_server(args,&port);
+  // room for a handful of clients after what the server keeps back
+  struct rlimit rl={48,48};
+  if (pid<0||prlimit(pid,RLIMIT_NOFILE,&rl,NULL)) {
+    printf("FAIL: Could not start a server with a low open file limit\n");
+    stop_test_server(pid);
+    return -1;
+  }
+  // the server looks at the limit once a second
+  sleep(2);
+  int socks[12],i,admitted=0,rejected=0;
+  for(i=0;i<12;i++) {
+    char buffer[8192];
+    int bytes=0;
+    socks[i]=connect_to_port(port);
+    if (socks[i]<0) continue;
+    read_from_socket(socks[i],(unsigned char *)buffer,&bytes,sizeof(buffer),2);
+    if (strstr(buffer,"Client count too great")) rejected++;
+    else if (strstr(buffer," 020 ")) admitted++;
+  }
+  failif(!admitted||!rejected,
+	 "Clients over the open file limit were not turned away",
+	 "Clients over the open file limit were turned away");
+  for(i=0;i<12;i++) if (socks[i]>-1) close(socks[i]);
+  usleep(500000);
+  int sock=new_connection_on(port,"admitted");
+  failif(sock<0,
+	 "Server did not take new clients once others had gone",
+	 "Server took new clients once others had gone");
+  if (sock>-1) close(sock);
+  stop_test_server(pid);
+  return 0;
+}
+
+// writes line to sock count times, throwing away whatever comes back
+// meanwhile. returns -1 if the server closed the connection.
+int send_repeatedly(int sock,char *line,int count)
+{
+  char discard[8192];
+  int len=strlen(line),done=0;
+  fcntl(sock,F_SETFL,fcntl(sock,F_GETFL,NULL)|O_NONBLOCK);
+  while(count) {
+    int w=send(sock,&line[done],len-done,MSG_NOSIGNAL);
+    if (w>0) {
+      done+=w;
+      if (done==len) { done=0; count--; }
+      continue;
+    }
+    if (w==-1&&errno!=EAGAIN) return -1;
+    struct pollfd fds={sock,POLLIN|POLLOUT,0};
+    poll(&fds,1,1000);
+    if (fds.revents&POLLIN&&read(sock,discard,sizeof(discard))==0) return -1;
+  }
+  return 0;
+}
+
+// how many lines STATS says were dropped, and connections closed, for
+// being too far behind
+int sendq_counts(int port,long long *dropped,long long *closed)
+{
+  char buffer[8192];
+  int sock=new_connection_on(port,"sendqwatch");
+  *dropped=*closed=-1;
+  if (sock<0) return -1;
+  char *counts=NULL;
+  if (!stats_report(sock,buffer,sizeof(buffer)))
+    counts=strstr(buffer,"sendq lines dropped ");
+  if (counts) sscanf(counts,"sendq lines dropped %lld, connections closed %lld",dropped,closed);
+  close(sock);
+  return counts?0:-1;
+}
+
+int test_sendq()
+{
+  /* Test that a client that does not read what it is sent is disconnected
+     once its send queue is over -q, or with -D has its oldest lines
+     dropped instead. */
+  if (!student_executable) {
+    printf("PROGRESS: Not testing send queues, as the server was already running\n");
+    return -1;
+  }
+  char line[512];
+  memset(line,'z',sizeof(line));
+  memcpy(line,"PRIVMSG sendqreader :",21);
+  strcpy(&line[sizeof(line)-3],"\n\r");
+  int drop,port=student_port+20;
+  for(drop=0;drop<2;drop++) {
+    char *args[]={"-q","65536",drop?"-D":NULL,NULL};
+    pid_t pid=launch_test_server(args,&port);
+    int sock1=pid>0?new_connection_on(port,"sendqsender"):-1;
+    int sock2=pid>0?new_connection_on(port,"sendqreader"):-1;
+    long long dropped=-1,closed=-1;
+    if (sock1>-1&&sock2>-1) {
+      // the reader never reads, so once the sockets between us are full
+      // the rest queues up in the server
+      int size=4096;
+      setsockopt(sock2,SOL_SOCKET,SO_RCVBUF,&size,sizeof(size));
+      send_repeatedly(sock1,line,20000);
+      usleep(500000);
+      sendq_counts(port,&dropped,&closed);
+    }
+    if (drop) failif(dropped<1||closed!=0,
+		     "Lines were not dropped for a client too far behind with -D",
+		     "Lines were dropped for a client too far behind with -D");
+    else failif(closed<1,
+		"A client too far behind was not disconnected",
+		"A client too far behind was disconnected");
+    if (sock1>-1) close(sock1);
+    if (sock2>-1) close(sock2);
+    stop_test_server(pid);
+  }
+  return 0;
+}
+
+int test_journal()
+{
+  /* Test that with -j, a server that is killed comes back with the
+     private messages it had journalled. */
+  if (!student_executable) {
+    printf("PROGRESS: Not testing the journal, as the server was already running\n");
+    return -1;
+  }
+  char dir[]="/tmp/testjournalXXXXXX";
+  if (!mkdtemp(dir)) {
+    printf("FAIL: Could not make a directory for the journal\n");
+    return -1;
+  }
+  char *args[]={"-j",dir,NULL};
+  int port=0;
+  pid_t pid=launch_test_server(args,&port);
+  int sock1=pid>0?new_connection_on(port,"jrnlsender"):-1;
+  int sock2=pid>0?new_connection_on(port,"jrnlreader"):-1;
+  char buffer[8192];
+  long long recovered=0;
+  if (sock1>-1&&sock2>-1) {
+    int i,bytes=0;
+    char *cmd="PRIVMSG jrnlreader :keep this\n\r";
+    for(i=0;i<5;i++) write(sock1,cmd,strlen(cmd));
+    // a line to two nicknames is journaled once
+    cmd="PRIVMSG jrnlreader,jrnlsender :keep both\n\r";
+    write(sock1,cmd,strlen(cmd));
+    read_until(sock2,buffer,&bytes,sizeof(buffer),"keep both");
+    usleep(100000);
+    stop_test_server(pid);
+    close(sock1);
+    close(sock2);
+    // the old server's socket may take a moment to go away, so come back
+    // on another port
+    pid=launch_test_server(args,&port);
+    sock1=pid>0?new_connection_on(port,"jrnlsender"):-1;
+    char *counts=NULL;
+    if (sock1>-1&&!stats_report(sock1,buffer,sizeof(buffer)))
+      counts=strstr(buffer,"journal messages recovered ");
+    if (counts) recovered=atoll(counts+27);
+  }
+  failif(recovered!=6,
+	 "Server did not recover the messages in its journal",
+	 "Server recovered the messages in its journal");
+  if (sock1>-1) close(sock1);
+  if (sock2>-1) close(sock2);
+  stop_test_server(pid);
+  char rm[1024];
+  snprintf(rm,1024,"rm -rf %s",dir);
+  system(rm);
+  return 0;
+}
+
+int test_flood()
+{
+  /* Test that with -f a client sending faster than it may has its lines
+     held back, and that every line is still delivered, once. */
+  if (!student_executable) {
+    printf("PROGRESS: Not testing flood control, as the server was already running\n");
+    return -1;
+  }
+  char *args[]={"-f","2",NULL};
+  int port=student_port+30;
+  pid_t pid=launch_test_server(args,&port);
+  int sock1=pid>0?new_connection_on(port,"floodsender"):-1;
+  int sock2=pid>0?new_connection_on(port,"floodreader"):-1;
+  int lines=0;
+  long long us=0;
+  if (sock1>-1&&sock2>-1) {
+    char buffer[8192]="",cmd[64];
+    int i,bytes=0;
+    struct timeval start,end;
+    gettimeofday(&start,NULL);
+    // two seconds' worth go at once, and the rest at two a second
+    for(i=0;i<10;i++) {
+      snprintf(cmd,64,"PRIVMSG floodreader :flood %d\n\r",i);
+      write(sock1,cmd,strlen(cmd));
+    }
+    for(i=0;i<10&&!strstr(buffer,"flood 9");i++)
+      read_until(sock2,buffer,&bytes,sizeof(buffer),"flood 9");
+    gettimeofday(&end,NULL);
+    us=(end.tv_sec-start.tv_sec)*1000000LL+end.tv_usec-start.tv_usec;
+    // anything sent twice would be right behind
+    read_from_socket(sock2,(unsigned char *)buffer,&bytes,sizeof(buffer),1);
+    char *p;
+    for(p=buffer;(p=strstr(p,":flood "));p++) lines++;
+  }
+  failif(lines!=10,
+	 "Lines held back by flood control were lost or sent twice",
+	 "Lines held back by flood control were each sent once");
+  failif(us<2000000,
+	 "Flood control did not hold back a client sending too fast",
+	 "Flood control held back a client sending too fast");
+  if (sock1>-1) close(sock1);
+  if (sock2>-1) close(sock2);
+  stop_test_server(pid);
+  return 0;
+}
+
+int test_flood_timeout()
+{
+  /* Test that a client whose lines flood control is holding back is not
+     timed out for being idle while they are held, and that timing it out
+     afterwards leaves the server running. */
+  if (!student_executable) {
+    printf("PROGRESS: Not testing flood control timeouts, as the server was already running\n");
+    return -1;
+  }
+  char *args[]={"-f","1",NULL};
+  int port=student_port+35;
+  pid_t pid=launch_test_server(args,&port);
+  int sock=pid>0?connect_to_port(port):-1;
+  long long us=0;
+  int closed=0;
+  if (sock>-1) {
+    char buffer[8192];
+    int i,bytes=0;
+    struct timeval start,end;
+    gettimeofday(&start,NULL);
+    // an unregistered client times out after 5 seconds, and these take
+    // about 10 to get through at a line a second
+    char lines[12*14+1]="";
+    for(i=0;i<12;i++) strcat(lines,"PRIVMSG a :b\n\r");
+    write(sock,lines,strlen(lines));
+    fcntl(sock,F_SETFL,fcntl(sock,F_GETFL,NULL)|O_NONBLOCK);
+    for(i=0;i<300&&!closed;i++) {
+      usleep(100000);
+      int r=read(sock,buffer,sizeof(buffer));
+      if (r==0||(r==-1&&errno!=EAGAIN)) closed=1;
+      else if (r>0) bytes+=r;
+    }
+    gettimeofday(&end,NULL);
+    us=(end.tv_sec-start.tv_sec)*1000000LL+end.tv_usec-start.tv_usec;
+    close(sock);
+  }
+  failif(!closed||us<8000000,
+	 "Client was timed out while flood control held its lines back",
+	 "Client was only timed out once flood control let its lines through");
+  // by now the held lines would all have gone, had the client stayed
+  if (us<12000000) usleep(12000000-us);
+  sock=pid>0?new_connection_on(port,"floodafter"):-1;
+  failif(sock<0,
+	 "Server did not take new clients after timing out a flooding one",
+	 "Server took new clients after timing out a flooding one");
+  if (sock>-1) close(sock);
+  stop_test_server(pid);
+  return 0;
+}
+
+int test_tracing()
+{
+  /* Test that with -T every PRIVMSG is traced, both being sent and being
+     delivered, and that STATS reports the stages. */
+  if (!student_executable) {
+    printf("PROGRESS: Not testing tracing, as the server was already running\n");
+    return -1;
+  }
+  char *args[]={"-T","1",NULL};
+  int port=student_port+40;
+  pid_t pid=launch_test_server(args,&port);
+  int sock1=pid>0?new_connection_on(port,"tracesender"):-1;
+  int sock2=pid>0?new_connection_on(port,"tracereader"):-1;
+  char buffer[8192]="";
+  long long events=0;
+  if (sock1>-1&&sock2>-1) {
+    int i,bytes=0;
+    char *cmd="PRIVMSG tracereader :where does the time go\n\r";
+    for(i=0;i<5;i++) write(sock1,cmd,strlen(cmd));
+    for(i=0;i<5&&bytes<5*strlen(cmd);i++)
+      read_from_socket(sock2,(unsigned char *)buffer,&bytes,sizeof(buffer),1);
+    usleep(200000);
+    char *counts=NULL;
+    if (!stats_report(sock1,buffer,sizeof(buffer)))
+      counts=strstr(buffer,"traced events ");
+    if (counts) events=atoll(counts+14);
+  }
+  // five sent, and at least one write of them to the reader
+  failif(events<6,
+	 "STATS did not count traced PRIVMSGs being sent and delivered",
+	 "STATS counted traced PRIVMSGs being sent and delivered");
+  failif(!strstr(buffer,"trace read to written p50"),
+	 "STATS did not report the latency of traced stages",
+	 "STATS reported the latency of traced stages");
+  if (sock1>-1) close(sock1);
+  if (sock2>-1) close(sock2);
+  stop_test_server(pid);
+  return 0;
+}
+
+int test_handover()
+{
+  /* Test that a server started with -H hands its clients over to a new
+     one started the same way, including a line a client is part way
+     through sending, and then exits. */
+  if (!student_executable) {
+    printf("PROGRESS: Not testing handover, as the server was already running\n");
+    return -1;
+  }
+  char dir[]="/tmp/testhandoverXXXXXX";
+  if (!mkdtemp(dir)) {
+    printf("FAIL: Could not make a directory for the handover socket\n");
+    return -1;
+  }
+  char path[64];
+  snprintf(path,64,"%s/handover",dir);
+  // thread mode cannot hand over, so use epoll unless a mode was given
+  char **a;
+  int threads=1;
+  for(a=student_args;*a;a++) if (!strcmp(*a,"-m")) threads=0;
+  char *args[]={"-m","epoll","-H",path,NULL};
+  char **more=threads?args:&args[2];
+  int port=student_port+60;
+  pid_t old=launch_test_server(more,&port);
+  int sock1=old>0?new_connection_on(port,"handsender"):-1;
+  int sock2=old>0?new_connection_on(port,"handreader"):-1;
+  pid_t new=-1;
+  int i,exited=0;
+  char buffer[8192]="";
+  if (sock1>-1&&sock2>-1) {
+    write(sock1,"PRIVMSG handreader :split ",26);
+    usleep(200000);
+    new=launch_server(student_executable,student_args,more,port);
+    for(i=0;i<50&&!exited;i++) {
+      usleep(100000);
+      exited=waitpid(old,NULL,WNOHANG)==old;
+    }
+    write(sock1,"across\n\r",8);
+    int bytes=0;
+    read_until(sock2,buffer,&bytes,sizeof(buffer),"split across");
+  }
+  failif(!exited,
+	 "Old server did not exit after handing over",
+	 "Old server exited after handing over");
+  failif(!strstr(buffer,"split across"),
+	 "Clients did not keep talking across a handover",
+	 "Clients kept talking across a handover");
+  if (sock1>-1) close(sock1);
+  if (sock2>-1) close(sock2);
+  if (!exited) stop_test_server(old);
+  stop_test_server(new);
+  unlink(path);
+  rmdir(dir);
+  return 0;
+}
+
+// waits for the next private message to arrive on sock without the polling
+// delay of read_from_socket(), so that round trips can be timed
+int wait_for_privmsg(int sock,char *buffer,int buffer_size)
+{
+  int bytes=0;
+  while(!strchr(buffer,'\n')||bytes==0) {
+    struct pollfd p={sock,POLLIN,0};
+    if (poll(&p,1,2000)<1) return -1;
+    int r=read(sock,&buffer[bytes],buffer_size-1-bytes);
+    if (r<1) return -1;
+    bytes+=r;
+    buffer[bytes]=0;
+  }
+  return strstr(buffer,"PRIVMSG")?0:-1;
+}
+
+// sends cmd from one client until the other receives a line containing
+// expected. servers that start at the same moment can find they have linked
+// in a loop and drop links to break it, so the network may take a few
+// seconds to settle; until it does the sender is told there is no such nick.
+int link_deliver(int from,int to,char *cmd,char *expected)
+{
+  char buffer[8192];
+  int tries,bytes;
+  for(tries=0;tries<10;tries++) {
+    write(from,cmd,strlen(cmd));
+    buffer[0]=0;
+    if (!wait_for_privmsg(to,buffer,sizeof(buffer)))
+      return strstr(buffer,expected)?0:-1;
+    bytes=0;
+    read_from_socket(from,(unsigned char *)buffer,&bytes,sizeof(buffer),1);
+  }
+  return -1;
+}
+
+int test_linking()
+{
+  /* Test that a mesh of three servers on loopback carries private messages
+     between users on different servers, keeps nick names unique across the
+     network, and forgets the users of a server that goes away. Links have
+     to give the password, so a stranger cannot pose as a server. We can
+     only do this when we started the first server ourselves. */
+  if (!student_executable) {
+    printf("PROGRESS: Not testing server linking, as the server was already running\n");
+    return -1;
+  }
+
+  int port1=0;
+  char *args1[]={"-N","one.test","-P","sesame",NULL};
+  pid_t pid1=launch_test_server(args1,&port1);
+  if (pid1<0) {
+    printf("FAIL: Could not start a server to link to\n");
+    return -1;
+  }
+
+  char buffer[8192];
+  int bytes=0;
+  int sock=connect_to_port(port1);
+  // let the greeting go first, as an io_uring server gives up on output
+  // still being sent when it closes the connection
+  read_until(sock,buffer,&bytes,sizeof(buffer)," 020 ");
+  write(sock,"PASS guess\n\rSERVER evil.test 1 :evil\n\r",38);
+  failif(read_until(sock,buffer,&bytes,sizeof(buffer),"Closing Link"),
+	 "SERVER without the link password was accepted",
+	 "SERVER without the link password was refused");
+  failif(strstr(buffer,"sesame")!=NULL,
+	 "Our link password was sent to a server that gave the wrong one",
+	 "Our link password was kept from a server that gave the wrong one");
+  close(sock);
+
+  char link1[64],link2[64];
+  snprintf(link1,64,"127.0.0.1:%d",port1);
+  int port2=free_port(port1+1);
+  char *args2[]={"-N","two.test","-L",link1,"-P","sesame",NULL};
+  pid_t pid2=launch_server(student_executable,student_args,args2,port2);
+  // wait for the second server before starting the third, which links to both
+  int i;
+  for(i=0;i<20;i++) {
+    usleep(100000);
+    if ((sock=connect_to_port(port2))>-1) { close(sock); break; }
+  }
+  snprintf(link2,64,"127.0.0.1:%d",port2);
+  int port3=free_port(port2+1);
+  char *args3[]={"-N","three.test","-L",link1,"-L",link2,"-P","sesame",NULL};
+  pid_t pid3=launch_server(student_executable,student_args,args3,port3);
+  sleep(1);
+
+  int sock1=new_connection_on(port1,"linkuser1");
+  int sock2=new_connection_on(port2,"linkuser2");
+  int sock3=new_connection_on(port3,"linkuser3");
+  if (sock1<0||sock2<0||sock3<0) {
+    printf("FAIL: Could not create a registered connection on each of 3 linked servers\n");
+  } else {
+    char cmd[1024];
+
+    char *greeting=greetings[random()&7];
+    sprintf(cmd,"PRIVMSG linkuser3 :%s\n\r",greeting);
+    failif(link_deliver(sock1,sock3,cmd,greeting),
+	   "PRIVMSG did not reach a user on another server",
+	   "PRIVMSG reached a user on another server");
+
+    failif(link_deliver(sock3,sock2,"PRIVMSG linkuser2 :Wie geht's?\n\r",
+			"PRIVMSG linkuser2 :"),
+	   "PRIVMSG between the two newest servers was not delivered",
+	   "PRIVMSG between the two newest servers was delivered");
+
+    // a nick name held on one server cannot be taken on another
+    bytes=0;
+    sock=connect_to_port(port2);
+    read_from_socket(sock,(unsigned char *)buffer,&bytes,sizeof(buffer),2);
+    write(sock,"NICK linkuser1\n\r",16);
+    bytes=0;
+    failif(read_until(sock,buffer,&bytes,sizeof(buffer)," 433 "),
+	   "Nick name in use on another server was not refused",
+	   "Nick name in use on another server was refused");
+    close(sock);
+
+    // time round trips between the first and third servers
+    struct timeval start,end;
+    int trips;
+    gettimeofday(&start,NULL);
+    for(trips=0;trips<100;trips++) {
+      buffer[0]=0;
+      write(sock1,"PRIVMSG linkuser3 :ping\n\r",25);
+      if (wait_for_privmsg(sock3,buffer,sizeof(buffer))) break;
+      buffer[0]=0;
+      write(sock3,"PRIVMSG linkuser1 :pong\n\r",25);
+      if (wait_for_privmsg(sock1,buffer,sizeof(buffer))) break;
+    }
+    gettimeofday(&end,NULL);
+    long long us=(end.tv_sec-start.tv_sec)*1000000LL+end.tv_usec-start.tv_usec;
+    long long one_way=trips?us/(trips*2):0;
+    printf("PROGRESS: %d round trips across linked servers, %lld usec per message\n",
+	   trips,one_way);
+    failif(trips<100||one_way>50000,
+	   "Messages across linked servers take more than 50ms",
+	   "Messages across linked servers take less than 50ms");
+
+    // once the second server goes, its users are gone too
+    kill(pid2,SIGKILL);
+    pid2=-1;
+    usleep(500000);
+    write(sock1,"PRIVMSG linkuser2 :Hallo?\n\r",27);
+    bytes=0;
+    failif(read_until(sock1,buffer,&bytes,sizeof(buffer)," 401 "),
+	   "User on a server that went away is still known",
+	   "User on a server that went away is no longer known");
+  }
+
+  if (sock1>-1) { write(sock1,"QUIT\r\n",6); close(sock1); }
+  if (sock2>-1) { write(sock2,"QUIT\r\n",6); close(sock2); }
+  if (sock3>-1) { write(sock3,"QUIT\r\n",6); close(sock3); }
+  if (pid2>0) kill(pid2,SIGKILL);
+  if (pid3>0) kill(pid3,SIGKILL);
+  stop_test_server(pid1);
+  return 0;
+}
+
+int test_netjoin()
+{
+  /* Test that when two servers that each gave out the same nick name are
+     linked, both holders are killed, so that the two sides agree on who has
+     it: nobody. The second server is started linking to the first before
+     the first is up, so that the users register before it tries again. */
+  if (!student_executable) {
+    printf("PROGRESS: Not testing nick collisions, as the server was already running\n");
+    return -1;
+  }
+
+  char link1[64],buffer[8192];
+  int bytes,i;
+  int port1=free_port(student_port+100);
+  snprintf(link1,64,"127.0.0.1:%d",port1);
+  int port2=port1;
+  char *args2[]={"-N","two.test","-L",link1,"-P","sesame",NULL};
+  pid_t pid2=launch_test_server(args2,&port2);
+  int sock2=register_on(port2,"clash");
+  char *args1[]={"-N","one.test","-P","sesame",NULL};
+  pid_t pid1=launch_server(student_executable,student_args,args1,port1);
+  int sock1=-1;
+  for(i=0;i<30&&sock1<0;i++) {
+    usleep(100000);
+    sock1=register_on(port1,"clash");
+  }
+  if (pid1<0||pid2<0||sock1<0||sock2<0) {
+    printf("FAIL: Could not register the same nick on two unlinked servers\n");
+  } else {
+    // the second server tries the link again within 5 seconds
+    bytes=0;
+    for(i=0;i<4;i++)
+      if (!read_until(sock1,buffer,&bytes,sizeof(buffer)," KILL clash ")) break;
+    int killed1=i<4;
+    bytes=0;
+    int killed2=!read_until(sock2,buffer,&bytes,sizeof(buffer)," KILL clash ");
+    failif(!killed1||!killed2,
+	   "Both holders of a nick were not killed when their servers linked",
+	   "Both holders of a nick were killed when their servers linked");
+
+    // the nick is then free on both sides, and found through the link
+    close(sock1);
+    close(sock2);
+    sock1=sock2=-1;
+    for(i=0;i<20&&sock1<0;i++) {
+      usleep(100000);
+      sock1=register_on(port1,"clash");
+    }
+    sock2=register_on(port2,"clashed");
+    failif(sock1<0||sock2<0||
+	   link_deliver(sock2,sock1,"PRIVMSG clash :Who are you?\n\r","PRIVMSG clash :"),
+	   "A nick freed by a collision was not routed the same way on both servers",
+	   "A nick freed by a collision was routed the same way on both servers");
+  }
+
+  if (sock1>-1) close(sock1);
+  if (sock2>-1) close(sock2);
+  stop_test_server(pid2);
+  stop_test_server(pid1);
+  return 0;
+}
+
+int test_link_rename()
+{
+  /* Test that a user on another server who changes to a nick name that is
+     in use here is kept under their old one and sent a KILL back, and is
+     only forgotten once their QUIT comes. We pose as that other server. */
+  if (!student_executable) {
+    printf("PROGRESS: Not testing nick changes over a link, as the server was already running\n");
+    return -1;
+  }
+
+  int port=student_port+110;
+  char *args[]={"-N","one.test","-P","sesame",NULL};
+  pid_t pid=launch_test_server(args,&port);
+  int user=pid<0?-1:register_on(port,"taken");
+  int link=user<0?-1:connect_to_port(port);
+  if (link<0) {
+    printf("FAIL: Could not link to a server with a registered user\n");
+  } else {
+    char buffer[8192];
+    int bytes=0;
+    read_until(link,buffer,&bytes,sizeof(buffer)," 020 ");
+    char *cmd="PASS sesame\n\rSERVER fake.test 1 :fake\n\r"
+      "NICK mover 1 myusername myserver fake.test + :mover\n\r:mover NICK taken\n\r";
+    write(link,cmd,strlen(cmd));
+    bytes=0;
+    failif(read_until(link,buffer,&bytes,sizeof(buffer)," KILL taken "),
+	   "A NICK change over a link to a nick in use here was not answered with KILL",
+	   "A NICK change over a link to a nick in use here was answered with KILL");
+
+    cmd="PRIVMSG mover :Still there?\n\r";
+    write(user,cmd,strlen(cmd));
+    bytes=0;
+    failif(read_until(link,buffer,&bytes,sizeof(buffer)," PRIVMSG mover "),
+	   "A user whose NICK change clashed lost their old nick before they were killed",
+	   "A user whose NICK change clashed kept their old nick until they were killed");
+
+    cmd=":taken QUIT :Killed\n\r";
+    write(link,cmd,strlen(cmd));
+    usleep(200000);
+    cmd="PRIVMSG mover :Gone?\n\r";
+    write(user,cmd,strlen(cmd));
+    bytes=0;
+    failif(read_until(user,buffer,&bytes,sizeof(buffer)," 401 "),
+	   "A user whose NICK change clashed was still known after their QUIT",
+	   "A user whose NICK change clashed was forgotten after their QUIT");
+  }
+
+  if (link>-1) close(link);
+  if (user>-1) close(user);
+  stop_test_server(pid);
+  return 0;
+}
+
+// bench.c builds on the client routines above, with its own main()
+#ifndef TEST_NO_MAIN
 int main(int argc,char **argv)
 {
-  if (argc!=2) {
-    fprintf(stderr,"usage: test <example program>\n");
+  if (argc<2) {
+    fprintf(stderr,"usage: test <example program> [program options]\n");
     exit(-1);
   }
 
   if (atoi(argv[1])==0)
-    launch_student_programme(argv[1]);
+    launch_student_programme(argv[1],&argv[2]);
   else {
     student_port=atoi(argv[1]);
     student_pid=99999;
@@ -789,6 +1882,22 @@ int main(int argc,char **argv)
   test_beforeregistration();
   test_registration();
   test_multipleclients();
+  test_nicknames();
+  test_channels();
+  test_stats();
+  test_idle();
+  test_reuseport();
+  test_slabs();
+  test_admission();
+  test_sendq();
+  test_journal();
+  test_flood();
+  test_flood_timeout();
+  test_tracing();
+  test_handover();
+  test_linking();
+  test_netjoin();
+  test_link_rename();
 
   int score=success*84/TOTAL_TESTS;
   printf("Passed %d of %d tests.\n"
@@ -809,3 +1918,4 @@ int main(int argc,char **argv)
 
   return 0;
 }
+#endif